@@ -9,37 +9,128 @@
 
 #include "AMF.h"
 #include "common.h"
+#include "ByteReader.h"
 
 #include <iostream>
+#include <memory>
+#include <algorithm>
+#include <string.h>
 #include <stdexcept>
 #include <stdio.h>
 #include <assert.h>
 
-class AMF * fread_AMF(FILE *fp) {
+static class AMF * fread_Array(ByteReader &r);
+static void skip_AMF(ByteReader &r);
+
+class AMF * fread_AMF(ByteReader &r) {
 	unsigned char type;
 
-	type = fread_8(fp);
+	type = r.read_8();
 
 	switch (type) {
 		case AMF_Double: // double
-			return new AMFDouble(fp);
+			return new AMFDouble(r);
 		case AMF_Boolean: // boolean
-			return new AMFBoolean(fp);
+			return new AMFBoolean(r);
 		case AMF_String: // string
-			return new AMFString(fp);
+			return new AMFString(r);
 		case AMF_Object: // object
-			return new AMFObject(fp);
+			return new AMFObject(r);
 		case AMF_Mixed_Array: // mixed_array
-			return new AMFMixed_Array(fp);
+			return new AMFMixed_Array(r);
 		case AMF_Array: // array
-			return new AMFArray(fp);
+			return fread_Array(r);
 		case AMF_Date: // date
-			return new AMFDate(fp);
+			return new AMFDate(r);
 	}
 
 	return NULL;
 }
 
+// Reads a array, which is packed into a AMFDoubleArray if it only holds doubles
+static class AMF * fread_Array(ByteReader &r) {
+	unsigned int size = r.read_32();
+
+	std::auto_ptr<AMFDoubleArray> d ( new AMFDoubleArray() );
+	unsigned char type;
+
+	while (size > 0 && r.peek_8(type) && type == AMF_Double) {
+		r.skip(1);
+		d->v.push_back( r.read_64() );
+		size--;
+	}
+
+	if (size == 0)
+		return d.release();
+
+	// Something else is in the array, so it has to be a AMFArray after all
+	std::auto_ptr<AMFArray> a ( new AMFArray() );
+
+	std::vector<double>::const_iterator i = d->v.begin();
+
+	for (; i != d->v.end(); i++)
+		a->v.push_back( new AMFDouble( *i ) );
+
+	while (size > 0) {
+		a->v.push_back ( fread_AMF(r) );
+		size--;
+	}
+
+	return a.release();
+}
+
+// Moves past a AMF value without decoding it
+static void skip_AMF(ByteReader &r) {
+	unsigned char type = r.read_8();
+	unsigned int size;
+
+	switch (type) {
+		case AMF_Double:
+			r.skip(8);
+			break;
+		case AMF_Boolean:
+			r.skip(1);
+			break;
+		case AMF_String:
+			r.skip(r.read_16());
+			break;
+		case AMF_Mixed_Array:
+			r.skip(4);
+			// Fall through, the rest is the same as a object
+		case AMF_Object:
+			while ((size = r.read_16()) != 0) {
+				r.skip(size);
+				skip_AMF(r);
+			}
+			r.skip(1);
+			break;
+		case AMF_Array:
+			size = r.read_32();
+			while (size > 0) {
+				skip_AMF(r);
+				size--;
+			}
+			break;
+		case AMF_Date:
+			r.skip(10);
+			break;
+		default:
+			throw vargs_exception("unknown AMF type %d", type);
+	}
+}
+
+// Reads a value in a map, objects and arrays are left encoded if we are reading memory
+static class AMF * fread_MapValue(ByteReader &r) {
+	unsigned char type;
+
+	if (r.file() == NULL && r.peek_8(type)) {
+		if (type == AMF_Object || type == AMF_Mixed_Array || type == AMF_Array)
+			return new AMFLazy(r);
+	}
+
+	return fread_AMF(r);
+}
+
 void fwrite_AMF(FILE *fp, class AMF *a) {
 	unsigned char type = a->type();
 
@@ -47,53 +138,47 @@ void fwrite_AMF(FILE *fp, class AMF *a) {
 	a->write(fp);
 }
 
-AMFDouble::AMFDouble(FILE *fp) { read(fp); }
+AMFDouble::AMFDouble(ByteReader &r) { read(r); }
 AMFDouble::AMFDouble(double d) : d(d) {};
 
-AMFBoolean::AMFBoolean(FILE *fp) { read(fp); }
+AMFBoolean::AMFBoolean(ByteReader &r) { read(r); }
+
+AMFString::AMFString(ByteReader &r) : p(NULL), len(0) { read(r); }
+AMFString::AMFString(const char *s) : p(NULL), len(0) { assign(s); };
+AMFString::AMFString(const char *s, size_t len) : p(s), len(len) {};
 
-AMFString::AMFString(FILE *fp) { read(fp); }
-AMFString::AMFString(const char *s) : s(s) {};
+AMFMap::AMFMap() : holes(0), entriessize(0), parent(NULL) {}
 
-AMFObject::AMFObject(FILE *fp) { read(fp); }
+AMFObject::AMFObject(ByteReader &r) { read(r); }
 AMFObject::AMFObject() {}
 
-AMFMixed_Array::AMFMixed_Array(FILE *fp) { read(fp); }
+AMFMixed_Array::AMFMixed_Array(ByteReader &r) { read(r); }
 AMFMixed_Array::AMFMixed_Array() {};
 
-AMFArray::AMFArray(FILE *fp) { read(fp); }
+AMFArray::AMFArray(ByteReader &r) { read(r); }
 AMFArray::AMFArray() { }
 
-AMFDate::AMFDate(FILE *fp) { read(fp); }
+AMFDoubleArray::AMFDoubleArray(ByteReader &r) { read(r); }
+AMFDoubleArray::AMFDoubleArray(size_t len) : v(len) { }
+
+AMFLazy::AMFLazy(ByteReader &r) : p(NULL), len(0) { read(r); }
+
+AMFDate::AMFDate(ByteReader &r) { read(r); }
 
 size_t AMFDouble::size() const { return 8; }
 size_t AMFBoolean::size() const { return 1; }
-size_t AMFString::size() const { return 2 + s.length(); }
+size_t AMFString::size() const { return 2 + len; }
 size_t AMFObject::size() const {
-	size_t length = 3;
-
-	std::map<AMFString *, AMF *, AMFStringLess>::const_iterator i = m.begin();
-
-	while (i != m.end()) {
-		length += (*i).first->size();
-		length += 1 + (*i).second->size();
-		i++;
-	}
-
-	return length;
+#ifdef AMF_DEBUG
+	assert( entriessize == sumEntries() );
+#endif
+	return 3 + entriessize;
 }
-size_t AMFMixed_Array::size() const { 
-	size_t length = 4 + 3;
-
-	std::map<AMFString *, AMF *, AMFStringLess>::const_iterator i = m.begin();
-
-	while (i != m.end()) {
-		length += (*i).first->size();
-		length += 1 + (*i).second->size();
-		i++;
-	}
-
-	return length;
+size_t AMFMixed_Array::size() const {
+#ifdef AMF_DEBUG
+	assert( entriessize == sumEntries() );
+#endif
+	return 4 + 3 + entriessize;
 }
 size_t AMFArray::size() const { 
 	size_t length = 4;
@@ -107,19 +192,22 @@ size_t AMFArray::size() const {
 
 	return length;
 }
+size_t AMFDoubleArray::size() const { return 4 + v.size() * (1 + 8); }
+size_t AMFLazy::size() const { return len - 1; }
 size_t AMFDate::size() const { return 10; }
 
 AMFMap::~AMFMap() {
-	std::map<AMFString *, AMF *, AMFStringLess>::iterator i = m.begin();
+	std::vector<Entry>::iterator i = entries.begin();
 
-	while (i != m.end()) {
-		delete (*i).first;
-		delete (*i).second;
+	while (i != entries.end()) {
+		// delete is fine with the NULLs in a hole
+		delete (*i).key;
+		delete (*i).value;
 
 		i++;
 	}
 
-	m.clear();
+	entries.clear();
 }
 
 AMFArray::~AMFArray() {
@@ -133,75 +221,122 @@ AMFArray::~AMFArray() {
 	v.clear();
 }
 
-void AMFDouble::read(FILE *fp) {
-	d = fread_64(fp); 
+void AMFDouble::read(ByteReader &r) {
+	d = r.read_64();
 }
 
-void AMFBoolean::read(FILE *fp) {
-	unsigned char tmp = fread_8(fp);
+void AMFBoolean::read(ByteReader &r) {
+	unsigned char tmp = r.read_8();
 	b = (tmp != 0);
 }
 
-void AMFString::read(FILE *fp) {
+void AMFString::read(ByteReader &r) {
+
+	len = r.read_16();
 
-	unsigned short len = fread_16(fp);
-	s.reserve(len);
+	// If we can, just point at the string
+	p = (const char *) r.view(len);
 
-	while (len > 0) {
-		unsigned char c = fread_8(fp);		
-		s += c;
+	if (p == NULL) {
+		s.resize(len);
+		if (len > 0)
+			r.read_s(&s[0], len);
 
-		len--;
+		p = s.data();
 	}
 }
 
-void AMFObject::read(FILE *fp) {
-	AMFString *key = new AMFString(fp);
+void AMFString::assign(const char *str) {
+	assert(str != NULL);
+
+	s = str;
+	p = s.data();
+	len = s.length();
+}
+
+int AMFString::compare(const AMFString &a) const {
+	int ret = memcmp(p, a.p, std::min(len, a.len));
+
+	if (ret != 0)
+		return ret;
+
+	return (len < a.len) ? -1 : (len > a.len);
+}
+
+void AMFObject::read(ByteReader &r) {
+	std::auto_ptr<AMFString> key ( new AMFString(r) );
 
-	while (key->s.length() != 0) {
-		AMF *object = fread_AMF(fp);
-		m[key] = object;
+	while (key->length() != 0) {
+		AMF *object = fread_MapValue(r);
+		put(key.release(), object);
 
-		key = new AMFString(fp);
+		key.reset( new AMFString(r) );
 	}
 
 	// Should be a single byte 9 now
-	fseeko(fp, 1, SEEK_CUR);
+	r.skip(1);
 }
 
-void AMFMixed_Array::read(FILE *fp) {
+void AMFMixed_Array::read(ByteReader &r) {
 	
 	// Read the size of this array (however we never actually use it)
-	fread_32(fp);
+	r.read_32();
 
-	AMFString *key = new AMFString(fp);
+	std::auto_ptr<AMFString> key ( new AMFString(r) );
 
-	//while (size > 0) {
-	while (key->s.length() != 0) {
-		AMF *object = fread_AMF(fp);
-		m[key] = object;
+	while (key->length() != 0) {
+		AMF *object = fread_MapValue(r);
+		put(key.release(), object);
 
-		key = new AMFString(fp);
+		key.reset( new AMFString(r) );
 	}
-	
-	delete key;
 
 	// Should be a single byte 9 now
-	fseeko(fp, 1, SEEK_CUR);
+	r.skip(1);
+}
+
+void AMFArray::read(ByteReader &r) {
+	unsigned int size = r.read_32();
+
+	while (size > 0) {
+		v.push_back ( fread_AMF(r) );
+		size--;
+	}
 }
 
-void AMFArray::read(FILE *fp) {
-	unsigned int size = fread_32(fp);
+void AMFDoubleArray::read(ByteReader &r) {
+	unsigned int size = r.read_32();
+
+	v.clear();
+	v.reserve(size);
 
 	while (size > 0) {
-		v.push_back ( fread_AMF(fp) );
+		if (r.read_8() != AMF_Double)
+			throw std::runtime_error("AMF array element is not a double");
+
+		v.push_back( r.read_64() );
 		size--;
 	}
 }
 
-void AMFDate::read(FILE *fp) {
+void AMFLazy::read(ByteReader &r) {
+	assert(r.file() == NULL);
+
+	p = r.view(0);
+
+	off_t start = r.tell();
+	skip_AMF(r);
+	len = (size_t)(r.tell() - start);
+}
+
+AMF *AMFLazy::decode() const {
+	ByteReader r(p, len);
+	return fread_AMF(r);
+}
+
+void AMFDate::read(ByteReader &r) {
 	//TODO
-	fread(b, 1, 10, fp);
+	r.read_s(b, 10);
 }
 
 
@@ -214,16 +349,18 @@ void AMFBoolean::write(FILE *fp) const {
 }
 
 void AMFString::write(FILE *fp) const {
-	fwrite_16(fp, (unsigned short) s.length() );
-	fwrite_s(fp, s.data(), s.length());
+	fwrite_16(fp, (unsigned short) len );
+	fwrite_s(fp, p, len);
 }
 
-void AMFObject::write(FILE *fp) const {
-	std::map<AMFString *, AMF *, AMFStringLess>::const_iterator i = m.begin();
+void AMFMap::write_entries(FILE *fp) const {
+	std::vector<Entry>::const_iterator i = entries.begin();
 
-	while (i != m.end()) {
-		(*i).first->write(fp);
-		fwrite_AMF(fp, (*i).second);
+	while (i != entries.end()) {
+		if ((*i).key != NULL) {
+			(*i).key->write(fp);
+			fwrite_AMF(fp, (*i).value);
+		}
 
 		i++;
 	}
@@ -231,19 +368,14 @@ void AMFObject::write(FILE *fp) const {
 	fwrite_s(fp, "\x00\x00\x09", 3); 
 }
 
-void AMFMixed_Array::write(FILE *fp) const {
-	fwrite_32(fp, (unsigned short) m.size());
-
-	std::map<AMFString *, AMF *, AMFStringLess>::const_iterator i = m.begin();
-
-	while (i != m.end()) {
-		(*i).first->write(fp);
-		fwrite_AMF(fp, (*i).second);
+void AMFObject::write(FILE *fp) const {
+	write_entries(fp);
+}
 
-		i++;
-	}
+void AMFMixed_Array::write(FILE *fp) const {
+	fwrite_32(fp, (unsigned short) (entries.size() - holes));
 
-	fwrite_s(fp, "\x00\x00\x09", 3); 
+	write_entries(fp);
 }
 
 void AMFArray::write(FILE *fp) const {
@@ -258,39 +390,202 @@ void AMFArray::write(FILE *fp) const {
 	}
 }
 
+void AMFDoubleArray::write(FILE *fp) const {
+	fwrite_32(fp, (unsigned int)v.size());
+
+	if (v.empty())
+		return;
+
+	// Each element is its type followed by the double, built up in one go and written together
+	std::vector<unsigned char> buf( v.size() * (1 + 8), AMF_Double );
+
+	endian_swap64s(&buf[1], 1 + 8, &v[0], v.size());
+
+	fwrite_s(fp, &buf[0], buf.size());
+}
+
+void AMFLazy::write(FILE *fp) const {
+	fwrite_s(fp, p + 1, len - 1);
+}
+
 void AMFDate::write(FILE *fp) const {
 	fwrite_s(fp, b, 10);
 }
 
-void AMFMap::set(const char *key, AMF *data) {
+// FNV-1a
+static unsigned int hash_key(const char *key, size_t len) {
+	unsigned int h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+void AMFMap::reindex(size_t n) {
+	size_t slots = 8;
+
+	if (holes > 0) {
+		std::vector<Entry>::iterator last = entries.begin();
+
+		for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end(); i++) {
+			if ((*i).key != NULL)
+				*last++ = *i;
+		}
+
+		entries.erase(last, entries.end());
+		holes = 0;
+	}
+
+	// Keep the index at most half full
+	while (slots < n * 2)
+		slots *= 2;
+
+	index.assign(slots, 0);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		const AMFString *k = entries[i].key;
+		size_t slot = hash_key(k->data(), k->length()) & (slots - 1);
+
+		while (index[slot] != 0)
+			slot = (slot + 1) & (slots - 1);
+
+		index[slot] = (unsigned int)(i + 1);
+	}
+}
+
+int AMFMap::findSlot(const char *key, size_t len) const {
+
+	if (index.empty())
+		return -1;
+
+	AMFString k ( key, len );
+	size_t mask = index.size() - 1;
+	size_t slot = hash_key(key, len) & mask;
+
+	while (index[slot] != 0) {
+		if (index[slot] != REMOVED && entries[index[slot] - 1].key->compare(k) == 0)
+			return (int)slot;
+
+		slot = (slot + 1) & mask;
+	}
+
+	return -1;
+}
+
+int AMFMap::find(const char *key, size_t len) const {
+	int slot = findSlot(key, len);
+
+	return slot < 0 ? -1 : (int)index[slot] - 1;
+}
+
+size_t AMFMap::sumEntries() const {
+	size_t size = 0;
+
+	std::vector<Entry>::const_iterator i = entries.begin();
+
+	for ( ;i != entries.end(); i++) {
+		if ((*i).key != NULL)
+			size += (*i).key->size() + 1 + (*i).value->size();
+	}
+
+	return size;
+}
+
+void AMFMap::adopt(AMF *value) const {
+	AMFMap *m = dynamic_cast<AMFMap *>( value );
+
+	if ( m != NULL ) {
+		m->parent = this;
+		return;
+	}
+
+	AMFArray *a = dynamic_cast<AMFArray *>( value );
+
+	if ( a != NULL ) {
+		for ( std::vector<AMF *>::iterator i = a->v.begin(); i != a->v.end(); ++i )
+			adopt(*i);
+	}
+}
+
+void AMFMap::put(AMFString *key, AMF *data) {
 	assert(key != NULL);
 	assert(data != NULL);
 
-	// Remove the old one (if it exists)
-	remove(key);
+	adopt(data);
+
+	int i = find(key->data(), key->length());
+
+	// Replace the existing value, keeping the existing key and its place
+	if (i >= 0) {
+		Entry &e = entries[i];
+
+		entriessize -= 1 + e.value->size();
+		entriessize += 1 + data->size();
+
+		delete e.value;
+		e.value = data;
 
-	AMFString *k = new AMFString(key);
+		delete key;
+		return;
+	}
+
+	Entry e;
+	e.key = key;
+	e.value = data;
+
+	entries.push_back(e);
+	entriessize += key->size() + 1 + data->size();
+
+	// The removed slots fill up the index too, and are dropped by the reindex
+	if (entries.size() * 2 > index.size()) {
+		reindex(entries.size() - holes);
+
+	} else {
+		size_t mask = index.size() - 1;
+		size_t slot = hash_key(key->data(), key->length()) & mask;
 
-	// Insert the data
-	m[k] = data;
+		while (index[slot] != 0)
+			slot = (slot + 1) & mask;
+
+		index[slot] = (unsigned int)entries.size();
+	}
 }
 
-bool AMFMap::remove(const char *key) {
+void AMFMap::set(const char *key, AMF *data) {
 	assert(key != NULL);
+	assert(data != NULL);
 
-	AMFString k ( key );
+	put(new AMFString(key), data);
+}
 
-	// Check if this key already exists
-	std::map<AMFString *, AMF *, AMFStringLess >::iterator i = m.find( &k );
+bool AMFMap::remove(const char *key) {
+	assert(key != NULL);
 
-	if (i == m.end() )
+	int slot = findSlot(key, strlen(key));
+
+	if (slot < 0)
 		return false;
 
 	// Free old AMF data
-	delete (*i).first;
-	delete (*i).second;
+	Entry &e = entries[ index[slot] - 1 ];
+
+	entriessize -= e.key->size() + 1 + e.value->size();
 
-	m.erase(i);
+	delete e.key;
+	delete e.value;
+
+	// Leave a hole, so nothing after it moves and the index stays right
+	e.key = NULL;
+	e.value = NULL;
+	index[slot] = REMOVED;
+	holes++;
+
+	// Unless the map is mostly holes
+	if (holes * 2 > entries.size())
+		reindex(entries.size() - holes);
 
 	return true;
 }
@@ -298,16 +593,34 @@ bool AMFMap::remove(const char *key) {
 AMF * AMFMap::get(const char *key) const {
 	assert(key != NULL);
 
-	AMFString k ( key );
+	int i = find(key, strlen(key));
+
+	if (i < 0)
+		return NULL;
+
+	Entry &e = entries[i];
+
+	// Decode it now, and keep the decoded copy
+	AMFLazy *lazy = dynamic_cast<AMFLazy *>( e.value );
 
-	// Check if this key already exists
-	std::map<AMFString *, AMF *, AMFStringLess >::const_iterator i = m.find( &k );
+	if ( lazy != NULL ) {
+		e.value = lazy->decode();
+		adopt(e.value);
 
-	if (i != m.end() ) {
-		return (*i).second;
+		// Duplicate keys inside the value are dropped when decoding, so the size may change,
+		// and with it the size of every map holding this one
+		size_t before = lazy->size();
+		size_t after = e.value->size();
+
+		for ( const AMFMap *m = this; m != NULL; m = m->parent ) {
+			m->entriessize -= before;
+			m->entriessize += after;
+		}
+
+		delete lazy;
 	}
 
-	return NULL;
+	return e.value;
 }
 
 
@@ -322,13 +635,16 @@ std::ostream& AMFBoolean::operator << (std::ostream& os) const {
 	return os << this->b;
 }
 std::ostream& AMFString::operator << (std::ostream& os) const {
-	return os << "\"" << this->s << "\"";
+	os << "\"";
+	os.write(p, len);
+	return os << "\"";
 }
 std::ostream& AMFMap::operator << (std::ostream& os) const {
-	std::map<AMFString *, AMF *, AMFStringLess>::const_iterator i = m.begin();
+	std::vector<Entry>::const_iterator i = entries.begin();
 
-	for ( ;i != m.end(); i++) {
-		os << "\t\t" << (*i).first << ": " << (*i).second << std::endl;
+	for ( ;i != entries.end(); i++) {
+		if ((*i).key != NULL)
+			os << "\t\t" << (*i).key << ": " << (*i).value << std::endl;
 	}
 
 	return os;
@@ -343,6 +659,22 @@ std::ostream& AMFArray::operator << (std::ostream& os) const {
 
 	return os;
 }
+std::ostream& AMFDoubleArray::operator << (std::ostream& os) const {
+	std::vector<double>::const_iterator i = v.begin();
+
+	for (; i != v.end(); i++) {
+		os << "\t\t\t";
+		os.width(10);
+		os.precision(10);
+		os << (*i) << std::endl;
+	}
+
+	return os;
+}
+std::ostream& AMFLazy::operator << (std::ostream& os) const {
+	std::auto_ptr<AMF> amf ( decode() );
+	return amf->operator <<(os);
+}
 std::ostream& AMFDate::operator << (std::ostream& os) const {
 	return os << "TODO Date";
 }
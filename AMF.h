@@ -7,11 +7,16 @@
 	If you wish to use this product for commercial reasons, then please contact us
 */
 
+#ifndef _AMF_H_
+#define _AMF_H_
+
 #include <string>
 #include <map>
 #include <vector>
 #include <stdio.h>
 
+class ByteReader;
+
 class AMF {
 
 		#define AMF_Double 0
@@ -23,7 +28,7 @@ class AMF {
 		#define AMF_Date 11
 
 	public:
-		virtual void read(FILE *fp) = 0;
+		virtual void read(ByteReader &r) = 0;
 		virtual void write(FILE *fp) const = 0 ;
 
 		virtual size_t size() const = 0;
@@ -42,14 +47,14 @@ class AMFDouble : public AMF {
 
 		double d;
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual unsigned int type() const { return AMF_Double; };
 
-		AMFDouble(FILE *fp);
+		AMFDouble(ByteReader &r);
 		AMFDouble(double d);
 
 		virtual std::ostream& operator << (std::ostream& os) const;
@@ -60,57 +65,125 @@ class AMFBoolean : public AMF {
 
 		bool b;
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual unsigned int type() const { return AMF_Boolean; };
 
-		AMFBoolean(FILE *fp);
+		AMFBoolean(ByteReader &r);
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 };
 
+/**
+	A AMF string. When read from memory the string just refers to those bytes,
+	and is only copied if it is changed
+*/
 class AMFString : public AMF {
-	public:
+	private:
+		// The string, either pointing into the memory it was read from, or at s
+		const char *p;
+		size_t len;
+
+		// The string's own copy (if it has one)
 		std::string s;
 
-		virtual void read(FILE *fp);
+		// Not copyable
+		AMFString(const AMFString &);
+		AMFString & operator = (const AMFString &);
+
+	public:
+
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual unsigned int type() const { return AMF_String; };
 
-		AMFString(FILE *fp);
+		AMFString(ByteReader &r);
 		AMFString(const char *s);
 
-		virtual std::ostream& operator << (std::ostream& os) const;
-};
+		// Refers to the len bytes at s, which must outlive this string
+		AMFString(const char *s, size_t len);
 
+		const char *data() const { return p; };
+		size_t length() const { return len; };
 
-struct AMFStringLess : public std::binary_function <class AMFString *, class AMFString *, bool> {
-	bool operator()(const class AMFString * _Left, const class AMFString * _Right) const {
-		return (_Left->s < _Right->s);
-	}
-};
+		std::string str() const { return std::string(p, len); };
 
-/*
-struct AMFStringLess : public std::binary_function <class AMFString *, class AMFString *, bool> {
-	bool operator()(const class AMFString * _Left, const class AMFString * _Right) const {
-		return (_Left < _Right);
-	}
+		// Changes the string, which makes it a copy
+		void assign(const char *s);
+
+		// Compares like strcmp
+		int compare(const AMFString &a) const;
+
+		virtual std::ostream& operator << (std::ostream& os) const;
 };
-*/
 
+
+/**
+	A AMF object or mixed array. The keys are kept in the order they were read or
+	added, with a small hash index on the side for lookups. The serialised size of
+	the entries is kept up to date as they change, so size() doesn't walk the tree.
+	This means a value must not be changed once it is in the map, set it again instead
+	(building with -DAMF_DEBUG checks this, by walking the tree in size() anyway).
+	Each map also knows the map holding it, so when get() decodes a lazy value in place,
+	and the size changes, every map above it is kept up to date too.
+	A removed entry is left as a hole (with a NULL key) until there are too many of them
+*/
 class AMFMap : public AMF {
 	protected:	
-		std::map<AMFString *, AMF *, AMFStringLess > m;
+		struct Entry {
+			AMFString *key;
+			AMF *value;
+		};
+
+		// Mutable, since get() decodes lazy values in place
+		mutable std::vector<Entry> entries;
+
+		// How many of the entries have been removed
+		size_t holes;
+
+		// Open addressed hash of the keys, each slot is a index into entries plus one (zero is empty,
+		// REMOVED is a slot whose entry was removed, which lookups must keep looking past)
+		std::vector<unsigned int> index;
+
+		const static unsigned int REMOVED = ~0u;
+
+		// The serialised size of all the entries
+		mutable size_t entriessize;
+
+		// The map holding this one (through any arrays in between), or NULL
+		mutable const AMFMap *parent;
+
+		// Adds this key (which the map now owns), replacing the value of any existing key
+		void put(AMFString *key, AMF *data);
+
+		// Returns the slot in index of this key, or -1
+		int findSlot(const char *key, size_t len) const;
+
+		// Returns the position of this key in entries, or -1
+		int find(const char *key, size_t len) const;
+
+		// Closes up the holes, and rebuilds the hash index with room for at least n entries
+		void reindex(size_t n);
+
+		// Adds up the size of the entries (which entriessize should always be)
+		size_t sumEntries() const;
+
+		// Makes this the parent of value if it is a map, or of the maps in it if it is a array
+		void adopt(AMF *value) const;
+
+		void write_entries(FILE *fp) const;
 
 	public:
 
-		virtual void read(FILE *fp) = 0;
+		AMFMap();
+
+		virtual void read(ByteReader &r) = 0;
 		virtual void write(FILE *fp) const = 0;
 
 		virtual size_t size() const = 0;
@@ -119,13 +192,14 @@ class AMFMap : public AMF {
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 
-		// Sets this key, both key and data will be deleted when removed from the map
+		// Sets this key, both key and data will be deleted when removed from the map.
+		// An existing key keeps its place, a new one goes on the end
 		void set(const char *key, AMF *data);
 
 		// Removes this key, returns true if the key was removed
 		bool remove(const char *key);
 
-		// Gets this key		
+		// Gets this key (decoding it if it is lazy)
 		AMF *get(const char *key) const;
 
 		virtual ~AMFMap();
@@ -134,7 +208,7 @@ class AMFMap : public AMF {
 class AMFObject : public AMFMap {
 	public:
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
@@ -142,13 +216,13 @@ class AMFObject : public AMFMap {
 		virtual unsigned int type() const { return AMF_Object; };
 
 		AMFObject();
-		AMFObject(FILE *fp);
+		AMFObject(ByteReader &r);
 };
 
 class AMFMixed_Array : public AMFMap {
 	public:
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
@@ -156,7 +230,7 @@ class AMFMixed_Array : public AMFMap {
 		virtual unsigned int type() const { return AMF_Mixed_Array; };
 
 		AMFMixed_Array();
-		AMFMixed_Array(FILE *fp);
+		AMFMixed_Array(ByteReader &r);
 };
 
 class AMFArray : public AMF {
@@ -164,38 +238,91 @@ class AMFArray : public AMF {
 
 		std::vector<AMF *> v;
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual unsigned int type() const { return AMF_Array; };
 
-		AMFArray(FILE *fp);
+		AMFArray(ByteReader &r);
 		AMFArray();
 		virtual ~AMFArray();
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 };
 
+/**
+	A AMF array where every element is a double (such as the keyframe index).
+	The doubles are kept packed together, instead of as one AMFDouble each
+*/
+class AMFDoubleArray : public AMF {
+	public:
+
+		std::vector<double> v;
+
+		virtual void read(ByteReader &r);
+		virtual void write(FILE *fp) const;
+
+		virtual size_t size() const;
+
+		virtual unsigned int type() const { return AMF_Array; };
+
+		AMFDoubleArray(ByteReader &r);
+		AMFDoubleArray(size_t len = 0);
+
+		virtual std::ostream& operator << (std::ostream& os) const;
+};
+
+/**
+	A AMF value inside a map, that is left encoded until it is asked for.
+	Maps read from memory keep their objects and arrays like this, so big values
+	that are just going to be replaced (such as a old keyframe index) are never decoded.
+	Until then it is written back out exactly as it was read
+*/
+class AMFLazy : public AMF {
+	private:
+		// The type byte, then the encoded value. This is the memory it was read from
+		const unsigned char *p;
+		size_t len;
+
+	public:
+
+		// r must be reading memory, which must outlive this
+		virtual void read(ByteReader &r);
+		virtual void write(FILE *fp) const;
+
+		virtual size_t size() const;
+
+		virtual unsigned int type() const { return p[0]; };
+
+		AMFLazy(ByteReader &r);
+
+		// Returns a new decoded copy of the value
+		AMF *decode() const;
+
+		virtual std::ostream& operator << (std::ostream& os) const;
+};
+
 class AMFDate : public AMF {
 	public:
 
 		unsigned char b[10];
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual unsigned int type() const { return AMF_Date; };
 
-		AMFDate(FILE *fp);
+		AMFDate(ByteReader &r);
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 };
 
-class AMF * fread_AMF(FILE *fp);
+// Reads a AMF value. If r is reading memory, strings refer to that memory, so it must outlive them
+class AMF * fread_AMF(ByteReader &r);
 void fwrite_AMF(FILE *fp, class AMF *a);
 
-
+#endif
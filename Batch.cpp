@@ -0,0 +1,246 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "Batch.h"
+#include "FLV.h"
+#include "OutputFile.h"
+#include "ScanCache.h"
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using std::auto_ptr;
+using std::vector;
+
+// Orders jobs (by index) biggest first
+class BiggerJob {
+	public:
+		BiggerJob(const vector<BatchJob> &jobs) : jobs(jobs) {}
+
+		bool operator()(size_t a, size_t b) const {
+			return jobs[a].size > jobs[b].size;
+		}
+
+	private:
+		const vector<BatchJob> &jobs;
+};
+
+/**
+	Runs jobs from a Batch until there are none left
+*/
+class BatchWorker : public Thread {
+
+	public:
+
+		BatchWorker(Batch &batch, size_t id) : batch(batch), id(id) {}
+
+	protected:
+
+		void run() {
+			size_t job;
+
+			while ( batch.next(id, job) )
+				Batch::runJob( batch.jobs[job], batch.options );
+		}
+
+	private:
+
+		Batch &batch;
+		size_t id;
+};
+
+// Info written to stdout by many jobs at once would be mixed up
+static Mutex stdoutLock;
+
+// Returns the size of filename, or 0 if it isn't there (its job will fail when it runs)
+static off_t fileSize(const std::string &filename) {
+#ifdef WIN32
+	struct _stati64 st;
+
+	if ( _stati64(filename.c_str(), &st) )
+		return 0;
+#else
+	struct stat st;
+
+	if ( stat(filename.c_str(), &st) )
+		return 0;
+#endif
+
+	return st.st_size;
+}
+
+Batch::Batch(vector<BatchJob> &jobs, const Options &options) : jobs(jobs), options(options) {
+	for ( vector<BatchJob>::iterator i = jobs.begin(); i != jobs.end(); ++i )
+		i->size = fileSize( i->input );
+}
+
+Batch::~Batch() {
+	for ( vector<Queue *>::iterator i = queues.begin(); i != queues.end(); ++i )
+		delete *i;
+}
+
+void Batch::run(unsigned int threads) {
+
+	if ( jobs.empty() )
+		return;
+
+	threads = (unsigned int) std::max( (size_t)1, std::min( (size_t)threads, jobs.size() ) );
+
+	// Deal the jobs out biggest first, so each queue is biggest first too
+	vector<size_t> order ( jobs.size() );
+
+	for ( size_t i = 0; i < order.size(); i++ )
+		order[i] = i;
+
+	std::stable_sort( order.begin(), order.end(), BiggerJob(jobs) );
+
+	for ( unsigned int t = 0; t < threads; t++ )
+		queues.push_back( new Queue() );
+
+	for ( size_t i = 0; i < order.size(); i++ )
+		queues[ i % threads ]->jobs.push_back( order[i] );
+
+	// This thread is the first worker
+	vector<BatchWorker *> workers;
+
+	for ( unsigned int t = 1; t < threads; t++ ) {
+		auto_ptr<BatchWorker> worker ( new BatchWorker( *this, t ) );
+
+		// If we can't start any more threads, the others steal this one's jobs
+		try {
+			worker->start();
+		} catch ( const std::runtime_error & ) {
+			break;
+		}
+
+		workers.push_back( worker.release() );
+	}
+
+	size_t job;
+
+	while ( next(0, job) )
+		runJob( jobs[job], options );
+
+	for ( vector<BatchWorker *>::iterator i = workers.begin(); i != workers.end(); ++i ) {
+		(*i)->join();
+		delete *i;
+	}
+}
+
+bool Batch::next(size_t worker, size_t &job) {
+
+	assert ( worker < queues.size() );
+
+	// Our own queue first, then steal. Every queue is biggest first, so taking from the front
+	// (rather than the back, as work stealing usually does) means the biggest job left goes next
+	for ( size_t i = 0; i < queues.size(); i++ ) {
+		Queue &q = *queues[ (worker + i) % queues.size() ];
+
+		MutexLock lock ( q.lock );
+
+		if ( !q.jobs.empty() ) {
+			job = q.jobs.front();
+			q.jobs.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Indexes flv and saves it as the job's output
+template <class Stream>
+static void save(Stream &flv, BatchJob &job, const Batch::Options &options) {
+	flv.addMetaData();
+	flv.setPadding( options.padding );
+	flv.addIndex();
+	flv.setReadAhead( options.depth, options.buflen );
+	flv.setSidecar( options.sidecar );
+	flv.save( job.output.c_str() );
+
+	job.tags = flv.getTagCount();
+}
+
+void Batch::runJob(BatchJob &job, const Options &options) {
+
+	double began = wall_seconds();
+
+	try {
+		switch ( job.kind ) {
+
+			case BatchJob::Index: {
+				// The cache keeps the table of tags, which streaming the file through doesn't make
+				if ( ScanCache::enabled() ) {
+					FLVStream flv ( job.input.c_str(), ~0, false, options.mode );
+					save( flv, job, options );
+
+				} else {
+					FLVIndexer flv ( job.input.c_str(), options.mode );
+					save( flv, job, options );
+				}
+				break;
+			}
+
+			case BatchJob::Crop: {
+				FLVStream flv ( job.input.c_str(), job.end, false, options.mode );
+
+				flv.crop( job.start, job.end );
+				save( flv, job, options );
+				break;
+			}
+
+			case BatchJob::Info: {
+				std::ostringstream info;
+
+				// The basics are enough, but if the end of the file is damaged read it all
+				try {
+					FLVProbe probe ( job.input.c_str(), options.mode );
+					probe.printInfo( info );
+
+				} catch ( const std::runtime_error & ) {
+					FLVStream flv ( job.input.c_str(), ~0, false, options.mode );
+
+					info.str("");
+					flv.printInfo( info );
+					job.tags = flv.getTagCount();
+				}
+
+				std::string s = info.str();
+
+				if ( job.output == "-" ) {
+					MutexLock lock ( stdoutLock );
+					OutputFile out ( "-" );
+					fwrite_s( out.file(), s.data(), s.size() );
+				} else {
+					OutputFile out ( job.output.c_str() );
+					fwrite_s( out.file(), s.data(), s.size() );
+				}
+				break;
+			}
+		}
+
+		job.ok = true;
+
+	} catch ( const std::runtime_error &e ) {
+		job.error = e.what();
+
+	} catch ( const char *c ) {
+		job.error = c;
+	}
+
+	// Some messages end with a newline, which would break up the summary
+	job.error.erase( job.error.find_last_not_of("\r\n") + 1 );
+
+	job.seconds = wall_seconds() - began;
+}
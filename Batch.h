@@ -0,0 +1,111 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "InputFile.h"
+#include "ReadAhead.h"
+#include "Thread.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+	One job of a batch, and (once run) how it went
+*/
+struct BatchJob {
+
+	enum Kind {
+		Index,
+		Crop,
+		Info,
+	};
+
+	Kind kind;
+
+	std::string input;
+
+	// Where the new file (or the information) is written, "-" prints the information to stdout
+	std::string output;
+
+	// Crop times in ms
+	unsigned long start;
+	unsigned long end;
+
+	// The size of the input, bigger jobs are run first
+	off_t size;
+
+	bool ok;
+	std::string error;
+	double seconds;
+	unsigned int tags;
+
+	BatchJob() : kind(Index), start(0), end(0), size(0), ok(false), seconds(0), tags(0) {}
+};
+
+/**
+	Runs many jobs in one process, on a pool of threads. Each thread has its own queue of jobs,
+	and when that runs out it steals from the others. The jobs are dealt out biggest first, so
+	the big files (which take longest) start early and don't hold up the end of the batch
+*/
+class Batch {
+
+	public:
+
+		// How the jobs read and write their files
+		struct Options {
+			InputFile::Mode mode;
+			size_t padding;
+			size_t depth;
+			size_t buflen;
+
+			// Write a KeyFrameIndex beside each new file
+			bool sidecar;
+
+			Options() : mode(InputFile::Stdio), padding(0), depth(0), buflen(ReadAhead::DEFAULT_BUFFER_LEN), sidecar(false) {}
+		};
+
+		// The jobs must outlive us, they are updated with their results
+		Batch(std::vector<BatchJob> &jobs, const Options &options);
+
+		~Batch();
+
+		// Runs every job, on up to threads threads
+		void run(unsigned int threads);
+
+		// Runs one job, recording how it went in it
+		static void runJob(BatchJob &job, const Options &options);
+
+	private:
+
+		friend class BatchWorker;
+
+		std::vector<BatchJob> &jobs;
+		Options options;
+
+		// A worker's queue of jobs (by index), biggest first
+		struct Queue {
+			Mutex lock;
+			std::deque<size_t> jobs;
+		};
+
+		std::vector<Queue *> queues;
+
+		// Takes the next job for worker, from its own queue, or if that is empty the biggest
+		// left in another's. Returns false once every queue is empty
+		bool next(size_t worker, size_t &job);
+
+		// Not copyable
+		Batch(const Batch &);
+		Batch & operator = (const Batch &);
+};
+
+#endif
@@ -0,0 +1,366 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "ByteReader.h"
+#include "IoUring.h"
+
+#include <string.h>
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+
+ByteReader::ByteReader(FILE *fp, off_t start, size_t buflen) : fp(fp), src(NULL), sequential(false), ownbuf(true), buf(NULL), buflen(buflen), cur(NULL), end(NULL), bufpos(start),
+	ring(NULL), current(0), nextChunk(0), limit(0), headroom(0), chunklen(0) {
+
+	assert ( fp != NULL );
+	assert ( buflen >= 16 );
+	assert ( start >= 0 );
+
+	buf = new unsigned char[ buflen ];
+	cur = buf;
+	end = buf;
+}
+
+ByteReader::ByteReader(const unsigned char *data, size_t len, off_t base) 
+	: fp(NULL), src(NULL), sequential(false), ownbuf(false), buf(const_cast<unsigned char *>(data)), buflen(len), cur(buf), end(buf + len), bufpos(base),
+	ring(NULL), current(0), nextChunk(0), limit(0), headroom(0), chunklen(0) {
+
+	assert ( data != NULL || len == 0 );
+}
+
+ByteReader::~ByteReader() {
+
+	// The kernel must be done with the buffers before they go
+	try {
+		while ( !chunks.empty() ) {
+			wait( chunks.front().buffer );
+			chunks.pop_front();
+		}
+	} catch (std::exception &) {}
+
+	delete ring;
+
+	// buf is one of the buffers when reading ahead
+	if ( !buffers.empty() ) {
+		for ( size_t b = 0; b < buffers.size(); b++ )
+			delete [] buffers[b];
+
+	} else if (ownbuf)
+		delete [] buf;
+}
+
+void ByteReader::readAhead(off_t limit) {
+
+	if ( fp == NULL || sequential || ring != NULL )
+		return;
+
+	ring = IoUring::create(READ_AHEAD_DEPTH);
+
+	if ( ring == NULL )
+		return;
+
+	this->limit = limit;
+
+	// Leftovers are always shorter than a fill, and fills from the chunks are at most half the buffer
+	headroom = buflen / 2;
+	chunklen = buflen - headroom;
+
+	buffers.push_back(buf);
+	current = 0;
+
+	for ( size_t i = 0; i < READ_AHEAD_DEPTH; i++ ) {
+		buffers.push_back( new unsigned char[ buflen ] );
+		spare.push_back( buffers.size() - 1 );
+	}
+
+	results.resize( buffers.size() );
+	done.resize( buffers.size() );
+
+	nextChunk = bufpos + (off_t)(end - buf);
+	queueChunks();
+}
+
+void ByteReader::queueChunks() {
+
+	while ( !spare.empty() && nextChunk < limit ) {
+		Chunk c;
+		c.buffer = spare.back();
+		c.pos = nextChunk;
+		c.len = (size_t) std::min( (off_t)chunklen, limit - nextChunk );
+
+		// There are only as many buffers as room in the ring, so this can't fail
+		bool queued = ring->read(fileno(fp), buffers[c.buffer] + headroom, c.len, c.pos, c.buffer);
+		assert ( queued );
+		(void)queued;
+
+		spare.pop_back();
+		done[c.buffer] = false;
+		chunks.push_back(c);
+		nextChunk += c.len;
+	}
+
+	ring->submit();
+}
+
+size_t ByteReader::wait(size_t b) {
+
+	while ( !done[b] ) {
+		unsigned long long tag;
+		int result;
+
+		ring->complete(tag, result, true);
+
+		done[tag] = true;
+		results[tag] = result;
+	}
+
+	int result = results[b];
+
+	// Interrupted, so nothing was read, which leaves a gap the next fill reads normally
+	if ( result == -EINTR || result == -EAGAIN )
+		return 0;
+
+	if ( result < 0 )
+		throw vargs_exception( "%s:%d: io_uring read failed errno(%d)", __FILE__, __LINE__, -result );
+
+	return (size_t)result;
+}
+
+bool ByteReader::fillAhead() {
+
+	size_t avail = end - cur;
+	off_t pos = bufpos + (off_t)(end - buf);
+
+	// Drop the chunks that have been skipped past
+	while ( !chunks.empty() ) {
+		const Chunk &c = chunks.front();
+
+		if ( c.pos + (off_t)wait(c.buffer) > pos )
+			break;
+
+		spare.push_back(c.buffer);
+		chunks.pop_front();
+	}
+
+	if ( chunks.empty() )
+		return false;
+
+	Chunk c = chunks.front();
+
+	// A short read left a gap, so drop the rest and fill normally, which starts them again from there
+	if ( c.pos > pos ) {
+		while ( !chunks.empty() ) {
+			wait( chunks.front().buffer );
+			spare.push_back( chunks.front().buffer );
+			chunks.pop_front();
+		}
+		return false;
+	}
+
+	chunks.pop_front();
+
+	// What is left goes just before the next bytes, in the headroom
+	unsigned char *b = buffers[c.buffer];
+	unsigned char *next = b + headroom + (size_t)(pos - c.pos);
+
+	memcpy(next - avail, cur, avail);
+
+	spare.push_back(current);
+	current = c.buffer;
+
+	buf = b;
+	cur = next - avail;
+	end = b + headroom + wait(c.buffer);
+	bufpos = c.pos - (off_t)headroom;
+
+	queueChunks();
+
+	return true;
+}
+
+bool ByteReader::fill(size_t len) {
+
+	size_t avail = end - cur;
+
+	if (avail >= len)
+		return true;
+
+	// Memory never gets any bigger
+	if (fp == NULL)
+		return false;
+
+	assert ( len <= buflen );
+
+	if ( ring != NULL && len <= headroom ) {
+		while ( (size_t)(end - cur) < len && fillAhead() ) {}
+
+		if ( (size_t)(end - cur) >= len )
+			return true;
+
+		avail = end - cur;
+	}
+
+	// Move what is left to the front of the buffer
+	memmove(buf, cur, avail);
+	bufpos += (off_t)(cur - buf);
+	cur = buf;
+	end = buf + avail;
+
+	size_t want = buflen - avail;
+
+	if (sequential) {
+		// The stream is always just past the end of the buffer
+		size_t got = fread(end, 1, want, fp);
+
+		if (got < want && ferror(fp))
+			throw vargs_exception( "%s:%d: fread failed errno(%d)", __FILE__, __LINE__, errno );
+
+		end += got;
+
+	} else {
+		end += fread_at(fp, bufpos + (off_t)avail, end, want);
+	}
+
+	// Start reading ahead again (after a gap), from the end of what we just read
+	if ( ring != NULL && chunks.empty() ) {
+		nextChunk = bufpos + (off_t)(end - buf);
+		queueChunks();
+	}
+
+	return (size_t)(end - cur) >= len;
+}
+
+void ByteReader::need(size_t len) {
+	if (!fill(len))
+		throw std::runtime_error("could not read requested bytes");
+}
+
+unsigned char ByteReader::read_8() {
+	need(1);
+	return *cur++;
+}
+
+unsigned short ByteReader::read_16() {
+	need(2);
+	unsigned short ret = (cur[0] << 8) | cur[1];
+	cur += 2;
+	return ret;
+}
+
+unsigned int ByteReader::read_24() {
+	need(3);
+	unsigned int ret = (cur[0] << 16) | (cur[1] << 8) | cur[2];
+	cur += 3;
+	return ret;
+}
+
+unsigned int ByteReader::read_32() {
+	need(4);
+	unsigned int ret = (cur[0] << 24) | (cur[1] << 16) | (cur[2] << 8) | cur[3];
+	cur += 4;
+	return ret;
+}
+
+double ByteReader::read_64() {
+	unsigned char b[8];
+
+	read_s(b, 8);
+	endian_swap64(b);
+
+	return *((double *)b);
+}
+
+void ByteReader::read_s(unsigned char *data, size_t len) {
+
+	size_t avail = end - cur;
+
+	if (len <= avail) {
+		memcpy(data, cur, len);
+		cur += len;
+		return;
+	}
+
+	// Small reads go through the buffer
+	if (len <= buflen / 2 || fp == NULL) {
+		need(len);
+		memcpy(data, cur, len);
+		cur += len;
+		return;
+	}
+
+	// Large reads empty the buffer, and then go direct to the file
+	memcpy(data, cur, avail);
+
+	off_t pos = tell() + (off_t)avail;
+	bufpos = pos + (off_t)(len - avail);
+	cur = buf;
+	end = buf;
+
+	size_t want = len - avail;
+	size_t got;
+
+	// Like a refill, so this never moves a shared FILE* either
+	if (sequential)
+		got = fread(data + avail, 1, want, fp);
+	else
+		got = fread_at(fp, pos, data + avail, want);
+
+	if (got < want)
+		throw std::runtime_error("could not read requested bytes");
+}
+
+void ByteReader::read_s(char *data, size_t len) {
+	read_s((unsigned char *)data, len);
+}
+
+const unsigned char *ByteReader::view(size_t len) {
+
+	if (fp != NULL)
+		return NULL;
+
+	need(len);
+
+	const unsigned char *d = cur;
+	cur += len;
+
+	return d;
+}
+
+bool ByteReader::peek_8(unsigned char &c) {
+	if (!fill(1))
+		return false;
+
+	c = *cur;
+	return true;
+}
+
+void ByteReader::skip(off_t len) {
+
+	assert ( len >= 0 );
+
+	if (len <= (off_t)(end - cur)) {
+		cur += len;
+		return;
+	}
+
+	// A stream can't seek, so the skipped bytes are read through the buffer
+	if (sequential) {
+		while (len > 0 && fill(1)) {
+			off_t n = std::min( len, (off_t)(end - cur) );
+			cur += n;
+			len -= n;
+		}
+		return;
+	}
+
+	// Throw away the buffer, the next fill will seek past the skipped bytes
+	bufpos = tell() + len;
+	cur = buf;
+	end = buf;
+}
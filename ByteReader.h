@@ -0,0 +1,156 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _BYTEREADER_H_
+#define _BYTEREADER_H_
+
+#include "common.h"
+
+#include <vector>
+#include <deque>
+
+class InputFile;
+class IoUring;
+
+/**
+	Reads big endian fields from a file through a large user-space buffer.
+	This replaces the fread_* functions on the parse path, so each field costs a
+	few instructions instead of a libc call. The reader keeps its own idea of the
+	file position, and refills with fread_at, so it never uses the FILE*'s position,
+	and many readers (in many threads) can share a FILE*
+
+	A reader going through a file (such as a scan) can also keep reads of the next chunks in
+	flight with io_uring, see readAhead. Each chunk is read straight into one of its buffers,
+	after room for what is left of the last one, so only those few bytes are copied
+
+	A file that can't seek (a pipe) is read in order instead, with fread, and skipped
+	bytes are read and thrown away, so only one reader can use it
+
+	The reader can also walk a block of memory (such as a mapped file), in which
+	case nothing is copied and there is never a refill
+*/
+class ByteReader {
+
+	public:
+
+		const static size_t DEFAULT_BUFFER_LEN = 1024 * 1024;
+
+		// Reads from fp, starting at start
+		ByteReader(FILE *fp, off_t start, size_t buflen = DEFAULT_BUFFER_LEN);
+
+		// Reads from len bytes of memory, which starts at offset base in the file
+		ByteReader(const unsigned char *data, size_t len, off_t base = 0);
+
+		~ByteReader();
+
+		unsigned char read_8();
+		unsigned short read_16();
+		unsigned int read_24();
+		unsigned int read_32();
+		double read_64();
+
+		void read_s(unsigned char *data, size_t len);
+		void read_s(char *data, size_t len);
+
+		// When reading memory, returns a pointer to the next len bytes and moves past them.
+		// Returns NULL (and reads nothing) when reading a file, since the buffer is reused
+		const unsigned char *view(size_t len);
+
+		// Looks at the next byte without consuming it, returns false at the end of the file
+		bool peek_8(unsigned char &c);
+
+		// Moves forward len bytes, without reading them if they are not already buffered
+		void skip(off_t len);
+
+		// Returns the position in the file of the next byte to be read
+		off_t tell() const { return bufpos + (off_t)(cur - buf); };
+
+		// Returns the FILE* we are reading from (NULL if we are reading memory)
+		FILE *file() const { return fp; };
+
+		// The file that tags read from this reader should refer back to (may be NULL)
+		const InputFile *source() const { return src; };
+		void setSource(const InputFile *src) { this->src = src; };
+
+		// Reads fp in order, for a file that can't seek (must be set before the first read)
+		void setSequential(bool sequential) { this->sequential = sequential; };
+
+		// Keeps READ_AHEAD_DEPTH reads of the file, up to limit, in flight with io_uring,
+		// if it is enabled (see IoUring). Does nothing for memory, or a file that can't seek
+		void readAhead(off_t limit);
+
+		const static size_t READ_AHEAD_DEPTH = 8;
+
+	private:
+
+		FILE *fp;
+		const InputFile *src;
+
+		// True if fp can't seek, so is read in order
+		bool sequential;
+
+		// True if buf belongs to us, false if it is someone else's memory
+		bool ownbuf;
+
+		unsigned char *buf;
+		size_t buflen;
+
+		// The valid bytes are between cur and end
+		unsigned char *cur;
+		unsigned char *end;
+
+		// Position in the file of buf[0]
+		off_t bufpos;
+
+		// A read ahead, of len bytes at pos into buffers[buffer] (after headroom bytes)
+		struct Chunk {
+			size_t buffer;
+			off_t pos;
+			size_t len;
+		};
+
+		// When reading ahead, the ring, and the buffers (buf is buffers[current]) with the result of
+		// each one's last read. The chunks in flight are in file order, and the rest of the buffers spare
+		IoUring *ring;
+		std::vector<unsigned char *> buffers;
+		std::vector<int> results;
+		std::vector<bool> done;
+		size_t current;
+		std::deque<Chunk> chunks;
+		std::vector<size_t> spare;
+
+		// Where the next chunk starts, and where to stop
+		off_t nextChunk;
+		off_t limit;
+
+		// Room left at the start of each buffer, then the chunk read after it
+		size_t headroom;
+		size_t chunklen;
+
+		// Tries to make len bytes available, returns false if the file ends first
+		bool fill(size_t len);
+
+		// Same as fill, but throws if the bytes are not available
+		void need(size_t len);
+
+		// Moves on to the chunk read ahead that has the next bytes, returns false if there isn't one
+		bool fillAhead();
+
+		// Starts reads into the spare buffers, up to limit
+		void queueChunks();
+
+		// Waits for the read into buffers[b], and returns how much it read
+		size_t wait(size_t b);
+
+		// Not copyable
+		ByteReader(const ByteReader &);
+		ByteReader & operator = (const ByteReader &);
+};
+
+#endif
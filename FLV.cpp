@@ -8,10 +8,18 @@
 */
 
 #include "FLV.h"
+#include "KeyFrameIndex.h"
+#include "OutputFile.h"
+#include "ReadAhead.h"
+#include "ScanCache.h"
+#include "TagScanner.h"
+#include "Thread.h"
 
 #include <iostream>
 #include <algorithm>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
 
 #include "Functors.h"
 
@@ -22,88 +30,143 @@ using std::endl;
 using std::auto_ptr;
 using std::vector;
 
-FLVStream::FLVStream(const char* filename, unsigned long end, bool verbose) 
-	: fp(NULL), meta( NULL ), ownTags(filename != NULL), 
-		audiotags ( 0 ), videotags (0), metatags (0), undefinedtags (0), keyframes (0), 
+// Writes the KeyFrameIndex of meta beside filename, which has just been saved through fp (still open)
+// stdout has no name to put it beside, so gets no index
+static void saveSidecar ( const MetaTag *meta, const char *filename, FILE *fp ) {
+
+	if ( strcmp( filename, "-" ) == 0 )
+		return;
+
+	off_t size = ftello( fp );
+
+	if ( size < 0 )
+		throw vargs_exception( "%s:%d: ftello failed errno(%d)", __FILE__, __LINE__, errno);
+
+	KeyFrameIndex ( meta ).save( KeyFrameIndex::filename( filename ).c_str(), size );
+}
+
+FLVStream::FLVStream(const char* filename, unsigned long end, bool verbose, InputFile::Mode mode, unsigned int threads, bool recover) 
+	: meta( NULL ), 
+		audiotags ( 0 ), videotags (0), metatags (0), undefinedtags (0), keyframes (0),
 		videocodec(VideoTag::Undefined), audiocodec(AudioTag::Undefined), 
-		width(0), height(0), start (0), end (0)  {
+		width(0), height(0), start (0), end (0),
+		readDepth(0), readBuffer(ReadAhead::DEFAULT_BUFFER_LEN), savedBytes(0), saveSeconds(0), sidecar(false)  {
 
 	// Check if we are making a blank FLVStream
 	if ( filename == NULL ) {
 		header.reset ( new TagHeader() );
 
 	} else {
-		init(filename, end, verbose);
+		init(filename, end, verbose, mode, threads, recover);
 	}
 }
 
-void FLVStream::init(const char* filename, unsigned long end, bool verbose) {
+void FLVStream::init(const char* filename, unsigned long end, bool verbose, InputFile::Mode mode, unsigned int threads, bool recover) {
 
 	assert ( filename != NULL );
 	assert ( strlen( filename ) > 0 );
 
-	fp = fopen(filename, "rb");
+	input.reset ( new InputFile( filename, mode ) );
 
-	if (fp == NULL)
-		throw vargs_exception("Error %d opening input file '%s'\n", errno, filename);
+	// All the parsing goes through a large buffer (or the mapping), instead of a stdio call per field
+	auto_ptr<ByteReader> r ( input->reader() );
+	ByteReader &reader = *r;
 
-	header.reset ( new TagHeader ( fp ) );
+	header.reset ( new TagHeader ( reader ) );
 
 	if ( verbose )
 		cout << header.get() << endl;
 
-	Tag *tag;
+	// A whole file that was parsed before, and hasn't changed since, is loaded from the cache instead
+	auto_ptr<ScanCache> cache;
 
-	while ( true ) { // Now start reading all the tags
-		
-		tag = fread_Tag(fp);
+	if ( !recover && end == (unsigned long)~0 && ScanCache::enabled() )
+		cache.reset( new ScanCache( *input ) );
 
-		if ( tag == NULL )
-			break;
+	if ( cache.get() != NULL && cache->valid() ) {
+		cache->restore( *this );
 
-		// Do read past a certain timestamp
-		if ( tag->getTimestamp() > end )
-			break;
+		// Printing each tag still reads them all, but nothing has to be worked out from them
+		while ( verbose ) {
+			auto_ptr<Tag> tag ( fread_Tag(reader) );
+
+			if ( tag.get() == NULL )
+				break;
+
+			cout << tag->filepos << " " << tag.get() << endl;
+		}
+
+	// Read the whole file in parallel (unless we are printing each tag, or stopping early)
+	} else if ( recover || (!verbose && threads > 1 && end == (unsigned long)~0) ) {
+		TagScanner scanner ( *input, reader.tell() );
+
+		if ( recover )
+			scanner.recover( tags, skipped );
+		else
+			scanner.scan( tags, threads );
 
-		if ( verbose )
-			cout << tag->filepos << " " << tag << endl;
+		for ( size_t i = 0; i < tags.size(); ++i )
+			addTagInformation( i );
 
-		addTagInformation( *tag );
+	} else {
+		while ( true ) { // Now start reading all the tags
+
+			auto_ptr<Tag> tag ( fread_Tag(reader) );
+
+			if ( tag.get() == NULL )
+				break;
+
+			// Do read past a certain timestamp
+			if ( tag->getTimestamp() > end )
+				break;
+
+			if ( verbose )
+				cout << tag->filepos << " " << tag.get() << endl;
+
+			// Only the (first) meta data tag is kept as a object, the rest are just a row in the table
+			if ( tag->type() == Tag::Meta && meta == NULL ) {
+				tags.push_back ( *tag, TagTable::Object );
+				meta = static_cast<MetaTag *> ( tag.release() );
+				addTagInformation( tags.size() - 1, meta );
 
-		tags.push_back ( tag );
+			} else {
+				tags.push_back ( *tag );
+				addTagInformation( tags.size() - 1, tag.get() );
+			}
+		}
 	}
 
+	if ( cache.get() != NULL && !cache->valid() )
+		ScanCache::store( *this );
+
 	// If we specified an end, we should run the crop method to make sure we don't have any frames we shouldn't
 	if ( end != (unsigned long)~0 ) {
 		crop(0, end);
 	}
 
 	if ( tags.size() > 0 ) {
-		this->start = tags.front()->getTimestamp();
-		this->end = tags.back()->getTimestamp();
+		this->start = tags.timestamp( 0 );
+		this->end = tags.timestamp( tags.size() - 1 );
 	}
 
 }
 
 FLVStream::~FLVStream() {
-
-	if ( ownTags )
-		for_each(tags.begin(), tags.end(), DeleteObject() );
-
-	if ( fp != NULL )
-		fclose(fp);
+	delete meta;
 }
 
-void FLVStream::addTagInformation(const Tag & tag ) {
+void FLVStream::addTagInformation(size_t i, const Tag *tag ) {
+
+	if ( i == 0 || tags.timestamp(i) < tags.timestamp(i - 1) )
+		timeRuns.push_back( i );
 
 	// Look at all the tags and count how many there are
-	switch ( tag.type() ) {
+	switch ( tags.type(i) ) {
 		case Tag::Audio: {
 			audiotags++;
 
 			if ( audiocodec == AudioTag::Undefined ) {
-				const AudioTag *a = static_cast<const AudioTag*> ( &tag );
-				audiocodec = a->getCodec();
+				audiocodec = tags.audioCodec(i);
 			}
 
 			break;
@@ -111,18 +174,31 @@ void FLVStream::addTagInformation(const Tag & tag ) {
 		case Tag::Video: {
 			videotags++;
 
-			const VideoTag *v = static_cast<const VideoTag*> ( &tag );
-			if (v->getFrameType() == VideoTag::KeyFrame) {
+			if (tags.frameType(i) == VideoTag::KeyFrame) {
 				keyframes++;
 
+				if ( keyframeRows.empty() || tags.timestamp(i) < tags.timestamp( keyframeRows.back() ) )
+					keyframeRuns.push_back( keyframeRows.size() );
+
+				keyframeRows.push_back( i );
+
 				// If we don't have width/height calculations, then work them out
 				if ( width == 0 || height == 0 ) {
+
+					// The dimensions are in the tag's data, so we need the full tag
+					auto_ptr<Tag> t;
+					if ( tag == NULL ) {
+						t.reset( tags.read(i) );
+						tag = t.get();
+					}
+
+					const VideoTag *v = static_cast<const VideoTag*> ( tag );
 					width = v->getWidth();
 					height = v->getHeight();
 				}
 
 				if ( videocodec == VideoTag::Undefined )
-					videocodec = v->getCodec();
+					videocodec = tags.videoCodec(i);
 			}
 
 			break;
@@ -130,8 +206,8 @@ void FLVStream::addTagInformation(const Tag & tag ) {
 		case Tag::Meta: {
 			// If we haven't got a meta tag yet, then use the first available
 			if ( meta == NULL ) {
-				// We do a nasty cast here!
-				meta = const_cast<MetaTag *> ( static_cast<const MetaTag *> ( &tag ) );
+				meta = static_cast<MetaTag *> ( tags.read(i) );
+				tags.setFlags(i, tags.flags(i) | TagTable::Object);
 			}
 
 			// Read some data from the meta tag
@@ -151,17 +227,19 @@ void FLVStream::calculateInformation() {
 	metatags = 0;
 	undefinedtags = 0;
 	keyframes = 0;
-	meta = NULL;
+	keyframeRows.clear();
+	keyframeRuns.clear();
+	timeRuns.clear();
 
-	// Start & end times in ms
-	start = tags.front()->getTimestamp();
-	end = tags.back()->getTimestamp();
+	if ( tags.empty() )
+		return;
 
-	tags_t::const_iterator i = tags.begin();
+	// Start & end times in ms
+	start = tags.timestamp( 0 );
+	end = tags.timestamp( tags.size() - 1 );
 
-	for ( ; i != tags.end(); ++i) {
-		const Tag *t = (*i);
-		addTagInformation( *t );
+	for ( size_t i = 0; i < tags.size(); ++i) {
+		addTagInformation( i );
 	}
 
 	// Make sure to correct the header
@@ -171,18 +249,23 @@ void FLVStream::calculateInformation() {
 }
 
 void FLVStream::printFrames() const {
-	FLVStream::printFrames( tags.begin(), tags.end() );
+	FLVStream::printFrames( 0, tags.size() );
 }
 
-void FLVStream::printFrames(tags_t::const_iterator begin, tags_t::const_iterator end) const {
-	tags_t::const_iterator i = begin;
+void FLVStream::printFrames(size_t begin, size_t end) const {
+
+	for ( size_t i = begin; i != end ; ++i) {
+		if ( tags.flags(i) & TagTable::Object ) {
+			cout << meta->filepos << " " << meta << endl;
+			continue;
+		}
 
-	for ( ; i != end ; ++i) {
-		cout << (*i)->filepos << " " << (*i) << endl;
+		auto_ptr<Tag> t ( tags.read(i) );
+		cout << tags.filepos(i) << " " << t.get() << endl;
 	}
 }
 
-void FLVStream::printInfo() const {
+void FLVStream::printInfo( std::ostream &out ) const {
 	double startd = start / 1000.00;
 	double endd = end / 1000.00;
 	double duration = endd - startd;
@@ -190,284 +273,1323 @@ void FLVStream::printInfo() const {
 	double fps = videotags / duration;
 	double keyinterval = duration / keyframes;
 
-	cout.precision(4);
-	cout << "Stream Info " << endl;
-	cout << "Tags Video: " << videotags << ", Audio: " << audiotags << ", Meta: " << metatags << ", Undefined: " << undefinedtags << endl;
-	cout << "Start: " << startd << "s, End: " << endd << "s, Duration: " << duration << "s @ " << fps << "fps, Keyframe interval: " << keyinterval << "s" << endl;
+	out.precision(4);
+	out << "Stream Info " << endl;
+	out << "Tags Video: " << videotags << ", Audio: " << audiotags << ", Meta: " << metatags << ", Undefined: " << undefinedtags << endl;
+	out << "Start: " << startd << "s, End: " << endd << "s, Duration: " << duration << "s @ " << fps << "fps, Keyframe interval: " << keyinterval << "s" << endl;
 
 }
 
-void FLVStream::crop ( unsigned int start, unsigned int end ) {
-
-	if (end <= start)
-		throw vargs_exception("End time must be larger than start time '%ld vs %ld'\n", start, end);
-
-	tags_t::iterator i = tags.begin();
-	tags_t::iterator startTag = tags.begin();
-	tags_t::iterator endTag = tags.end();
+void FLVStream::cropRange ( unsigned int &start, unsigned int end, size_t &startTag, size_t &endTag ) const {
 
-	// We need to find the smallest audio or keyframe to keep
-	for ( ; i != tags.end() ; ++i ) {
-		const Tag *t = (*i);
+	size_t i;
 
-		if (start > t->getTimestamp() ) {
-			// Make note of the last keyframe before the start
-			if ( t->type() == Tag::Video ) {
-				const VideoTag *vt = static_cast<const VideoTag *> ( t );
-
-				if ( vt->getFrameType() == VideoTag::KeyFrame )
-					startTag = i;
-			}
-		}
+	// Keep up to the first tag past the end
+	endTag = tags.size();
+	if ( end != (unsigned int)~0 )
+		endTag = seekTime( end + 1 );
 
-		if (end < t->getTimestamp())
-			break;
+	// And from the last keyframe before the start
+	startTag = 0;
+	if ( start > 0 ) {
+		startTag = keyframeAtOrBefore( start - 1, endTag );
 
+		if ( startTag == tags.size() )
+			startTag = 0;
 	}
-	endTag = i;
 
 	// The keyframe may be slightly earlier than start, so readjust start
-	start = std::min( start, (*startTag)->getTimestamp() );
+	start = std::min( start, tags.timestamp(startTag) );
 
 	// Now roll back a little to find any audio/meta tags within the time period
-	for ( i = startTag; i != tags.begin(); --i ) {
-		const Tag *t = (*i);
+	// (looking at the tag before i each time, so the first tag can be kept too)
+	for ( i = startTag; i != 0; --i ) {
 
 		// If this is a non keyframe video tag, then break
-		if ( t->type() == Tag::Video) {
-			const VideoTag *vt = static_cast<const VideoTag *> ( t );
-
-			if ( vt->getFrameType() != VideoTag::KeyFrame )
-				break;
-		}
+		if ( tags.type(i - 1) == Tag::Video && !tags.isKeyFrame(i - 1) )
+			break;
 
 		// If this tag is too early (and not the same time as us) then break
-		if (t->getTimestamp() < start) {
+		if (tags.timestamp(i - 1) < start) {
 			break;
 		}
 
-	} 
-	startTag = ++i;
+	}
+	startTag = i;
+}
+
+void FLVStream::crop ( unsigned int start, unsigned int end ) {
 
-	// Remove all the tags not in the range
-	//tags.insert(tags.begin(), startTag, endTag);
-	for_each(endTag, tags.end(), DeleteObject() );
-	tags.erase(endTag, tags.end());
+	if (end <= start)
+		throw vargs_exception("End time must be larger than start time '%ld vs %ld'\n", start, end);
+
+	size_t i;
+	size_t startTag;
+	size_t endTag;
 
-	for_each(tags.begin(), startTag, DeleteObject() );
-	tags.erase(tags.begin(), startTag);
+	cropRange( start, end, startTag, endTag );
 
-	// The meta tag might have been chopped
-	// TODO check it got chopped!, and/or keep a copy
-	meta = NULL;
+	// Remove all the tags not in the range
+	eraseTags(endTag, tags.size());
+	eraseTags(0, startTag);
 
 	// Reset the timestamp of the first tag!
-	unsigned long offset = tags[0]->getTimestamp();
+	unsigned long offset = tags.timestamp(0);
+
+	for (i = 0; i != tags.size(); i++) {
+		tags.setTimestamp( i, tags.timestamp(i) - offset );
 
-	for (i = tags.begin(); i != tags.end(); i++) {
-		(*i)->setTimestamp( (*i)->getTimestamp() - offset );
+		if ( tags.flags(i) & TagTable::Object )
+			meta->setTimestamp( tags.timestamp(i) );
 	}
 
 	// Don't forget to update information in this class
 	calculateInformation();
 }
 
-MetaTag *FLVStream::getMetaTag() {
-	
-	// If we don't have a meta tag then create one
-	if ( meta == NULL ) {
-		meta = new MetaTag("onMetaData");
-		
-		// Place this meta tag at the beginning
-		tags.insert( tags.begin(), meta );
-	}
+FLVStream *FLVStream::clip ( unsigned int start, unsigned int end ) const {
 
-	return meta;
+	if (end <= start)
+		throw vargs_exception("End time must be larger than start time '%ld vs %ld'\n", start, end);
+
+	size_t startTag;
+	size_t endTag;
+
+	cropRange( start, end, startTag, endTag );
+
+	return clipRows( startTag, endTag );
 }
 
-void FLVStream::save ( const char * filename ) {
+FLVStream *FLVStream::clipRows ( size_t startTag, size_t endTag ) const {
 
-	assert ( filename != NULL );
-	assert ( strlen( filename ) > 0 );
+	auto_ptr<FLVStream> flv ( new FLVStream() );
+
+	// The header can't be copied, so read it again
+	auto_ptr<ByteReader> r ( input->reader() );
+	flv->header.reset ( new TagHeader ( *r ) );
+
+	unsigned long offset = startTag < endTag ? tags.timestamp(startTag) : 0;
+
+	for ( size_t i = startTag; i < endTag; ++i ) {
+
+		if ( tags.flags(i) & TagTable::Object ) {
+
+			// A meta data tag we made ourselves isn't in the file, and crop would have replaced it anyway
+			if ( meta->in == NULL )
+				continue;
+
+			r.reset ( input->reader() );
+			r->skip( meta->filepos );
 
-	FILE *fp = fopen(filename, "wb");
+			flv->meta = static_cast<MetaTag *> ( fread_Tag( *r ) );
+			flv->meta->setTimestamp( tags.timestamp(i) - offset );
+			flv->tags.push_back( *flv->meta, TagTable::Object );
 
-	if (fp == NULL) {
-		throw vargs_exception("Error %d opening output file '%s'\n", errno, filename);
+		} else {
+			flv->tags.push_back( tags, i );
+		}
+
+		flv->tags.setTimestamp( flv->tags.size() - 1, tags.timestamp(i) - offset );
 	}
 
-	// Write out the FLV header
-	header->write(fp);
+	flv->calculateInformation();
+
+	flv->readDepth = readDepth;
+	flv->readBuffer = readBuffer;
+	flv->sidecar = sidecar;
+
+	return flv.release();
+}
+
+// Returns len bytes of in from offset, either from the mapping, or from buf, which is refilled
+// with the bytes from offset onwards if they are not already in it
+static const unsigned char *clipData(const InputFile &in, vector<unsigned char> &buf, off_t &bufpos, size_t &buflen, off_t offset, size_t len) {
 
-	// Now loop each tag
-	tags_t::const_iterator i = tags.begin();
+	const unsigned char *d = in.data(offset, len);
 
-	for ( ; i != tags.end(); ++i) {
-		(*i)->write(fp);
+	if ( d != NULL )
+		return d;
+
+	if ( offset < bufpos || offset + (off_t)len > bufpos + (off_t)buflen ) {
+
+		if ( buf.size() < len )
+			buf.resize( len );
+
+		bufpos = offset;
+		buflen = (size_t)std::min( (off_t)buf.size(), in.size() - offset );
+
+		in.read(bufpos, &buf[0], buflen);
 	}
 
-	fclose(fp);
+	return &buf[ offset - bufpos ];
 }
 
-void FLVStream::findKeyFrames ( vector<off_t> & keyFramesBytes, vector<double> & keyFramesTimes ) {
-	
-	keyFramesBytes.clear();
-	keyFramesBytes.reserve ( this->keyframes );
+// Writes the rows of clip from next onwards that are kept as objects (ie the meta data tag)
+static size_t writeClipObjects(FILE *fp, const TagTable &tags, MetaTag *meta, size_t next) {
+	for ( ; next < tags.size() && (tags.flags(next) & TagTable::Object); ++next )
+		meta->write(fp);
 
-	keyFramesTimes.clear();
-	keyFramesTimes.reserve ( this->keyframes );
+	return next;
+}
 
-	off_t offset = header->size();
+void FLVStream::saveClips ( const vector<FLVStream *> &clips, const vector<std::string> &filenames ) const {
 
-	tags_t::const_iterator i = tags.begin();
-	for ( ; i != tags.end(); ++i) {
-		const Tag *t = (*i);
+	assert ( clips.size() == filenames.size() );
 
-		if ( t->type() == Tag::Video ) {
+	const size_t n = clips.size();
 
-			const VideoTag *v = static_cast<const VideoTag*> ( t );
-			if ( v->getFrameType() == VideoTag::KeyFrame ) {
-				keyFramesTimes.push_back( v->getTimestamp() / 1000.00 );
-				keyFramesBytes.push_back( offset );
+	// Each clip's next row to write, and its file while it is being written
+	vector<size_t> next ( n, 0 );
+	vector<OutputFile *> outs ( n, (OutputFile *)NULL );
+
+	// The clips that are being written, and the clips in the order they start in our file
+	vector<size_t> active;
+	vector< std::pair<off_t, size_t> > starts;
+
+	vector<unsigned char> buf ( OutputFile::BUFFER_LEN );
+	off_t bufpos = 0;
+	size_t buflen = 0;
+
+	try {
+		for ( size_t c = 0; c < n; ++c ) {
+			const TagTable &t = clips[c]->tags;
+
+			// Clips without any tags (except the meta data) don't need any of our file
+			size_t first = 0;
+			while ( first < t.size() && (t.flags(first) & TagTable::Object) )
+				first++;
+
+			if ( first < t.size() ) {
+				assert ( t.source(first) == input.get() );
+				starts.push_back( std::make_pair( t.filepos(first), c ) );
+				continue;
 			}
+
+			OutputFile out ( filenames[c].c_str() );
+			clips[c]->header->write( out.file() );
+			writeClipObjects( out.file(), t, clips[c]->meta, 0 );
+
+			if ( clips[c]->sidecar )
+				saveSidecar( clips[c]->meta, filenames[c].c_str(), out.file() );
 		}
 
-		offset += t->size();
-	}
+		std::sort( starts.begin(), starts.end() );
 
-	assert ( keyFramesBytes.size() == keyFramesTimes.size() );
+		vector< std::pair<off_t, size_t> >::const_iterator s = starts.begin();
+
+		// Every clip is a run of our rows, so walk our rows, and pass each one to the clips it is in
+		for ( size_t i = 0; i < tags.size() && ( s != starts.end() || !active.empty() ); ++i ) {
+
+			if ( tags.flags(i) & TagTable::Object )
+				continue;
+
+			for ( ; s != starts.end() && s->first == tags.filepos(i); ++s ) {
+				size_t c = s->second;
+
+				outs[c] = new OutputFile( filenames[c].c_str() );
+				clips[c]->header->write( outs[c]->file() );
+				next[c] = writeClipObjects( outs[c]->file(), clips[c]->tags, clips[c]->meta, 0 );
+
+				active.push_back( c );
+			}
+
+			if ( active.empty() )
+				continue;
 
+			// Read this tag once for all the clips, they all write their own header (the timestamps differ)
+			const unsigned char *d = clipData( *input, buf, bufpos, buflen, tags.filepos(i), (size_t)tags.size(i) );
+
+			for ( size_t a = 0; a < active.size(); ) {
+				size_t c = active[a];
+				const TagTable &t = clips[c]->tags;
+				FILE *fp = outs[c]->file();
+
+				// A later meta data tag may have become the clip's object, which was already written
+				if ( t.filepos( next[c] ) != tags.filepos(i) ) {
+					++a;
+					continue;
+				}
+
+				t.writeHeader( fp, next[c] );
+				fwrite_s( fp, d + Tag::TAGHEADERLEN, (size_t)tags.size(i) - Tag::TAGHEADERLEN );
+
+				next[c] = writeClipObjects( fp, t, clips[c]->meta, next[c] + 1 );
+
+				// Close each clip once it is finished, so only the overlapping clips are open at once
+				if ( next[c] == t.size() ) {
+					if ( clips[c]->sidecar )
+						saveSidecar( clips[c]->meta, filenames[c].c_str(), fp );
+
+					delete outs[c];
+					outs[c] = NULL;
+
+					active.erase( active.begin() + a );
+				} else {
+					++a;
+				}
+			}
+		}
+
+		if ( !active.empty() || s != starts.end() )
+			throw std::runtime_error( "clip tags are not in this stream" );
+
+	} catch ( ... ) {
+		for_each( outs.begin(), outs.end(), DeleteObject() );
+		throw;
+	}
 }
 
-template <class T>
-AMFArray *makeDoubleArray(vector<T> a) {
-	auto_ptr<AMFArray> arr ( new AMFArray() );
+vector<size_t> FLVStream::splitPoints ( unsigned int interval ) const {
+
+	vector<size_t> points;
+
+	if ( tags.empty() )
+		return points;
 
-	typename vector< T >::const_iterator i = a.begin();
+	points.push_back( 0 );
 
-	while ( i != a.end() ) {
+	if ( interval == 0 )
+		return points;
 
-		AMFDouble *d = new AMFDouble ( (double) (*i) );
-		arr->v.push_back( d );
+	// Start a new segment at the first keyframe past each multiple of interval
+	unsigned long next = start + interval;
 
-		++i;
+	for ( vector<size_t>::const_iterator i = keyframeRows.begin(); i != keyframeRows.end(); ++i ) {
+		if ( tags.timestamp(*i) < next || *i == 0 )
+			continue;
+
+		points.push_back( *i );
+
+		while ( next <= tags.timestamp(*i) )
+			next += interval;
 	}
 
-	return arr.release();
+	return points;
 }
 
-void FLVStream::addIndex ( ) {
-	
-	// Get the meta tag first ( to ensure it exists )
-	MetaTag *meta = this->getMetaTag();
+/**
+	Writes some of the segments of a split, each writer has its own handle on the input
+*/
+class SegmentWriter : public Thread {
 
-	// Two arrays to hold the byte pos of each keyframe, as well as the keyframes timestamp
-	vector<off_t> keyFramesBytes;
-	vector<double> keyFramesTimes;
+	public:
 
-	// Find all the keyframes and add them into these array
-	findKeyFrames ( keyFramesBytes, keyFramesTimes );
+		// Set if anything went wrong
+		bool failed;
+		std::string error;
 
-	// Place the keyframes into the metadata struct
-	AMFObject *o = new AMFObject();
+		SegmentWriter(const InputFile &in, const vector<FLVStream *> &segments, const vector<std::string> &filenames, size_t first, size_t step)
+			: failed(false), in(in), segments(segments), filenames(filenames), first(first), step(step) {}
 
-	// Construct the keyframe arrays
-	o->set( "times", makeDoubleArray(keyFramesTimes) );
-	o->set( "filepositions", makeDoubleArray(keyFramesBytes) );
+	protected:
 
-	meta->set("keyframes", o);
+		virtual void run();
+
+	private:
+
+		const InputFile &in;
 
-	// Now update the byte positions (since the meta tag might have changed in size)
-	findKeyFrames ( keyFramesBytes, keyFramesTimes );
+		const vector<FLVStream *> &segments;
+		const vector<std::string> &filenames;
 
-	// Re-add it to complete the index
-	o->set( "filepositions", makeDoubleArray(keyFramesBytes) );
+		// This writer does the segments first, first + step, first + 2 * step, etc
+		size_t first;
+		size_t step;
+};
+
+void SegmentWriter::run() {
+
+	try {
+		// A stdin can't be opened again, but then there is only one writer, or the input is in memory
+		auto_ptr<InputFile> own;
+
+		if ( !in.isStdin() )
+			own.reset ( new InputFile( in.name(), in.isMapped() ? InputFile::Mmap : InputFile::Stdio ) );
+
+		for ( size_t i = first; i < segments.size(); i += step ) {
+			if ( own.get() != NULL )
+				segments[i]->setSource( &in, own.get() );
+
+			segments[i]->save( filenames[i].c_str() );
+		}
+
+	} catch ( const std::runtime_error &e ) {
+		failed = true;
+		error = e.what();
+	}
 }
 
-void FLVStream::addMetaData ( ) {
-	MetaTag *meta = this->getMetaTag();
+void FLVStream::split ( const vector<size_t> &points, const vector<std::string> &filenames, size_t padding, unsigned int threads ) const {
 
-	// Now add some extra fields
-	meta->set("duration", new AMFDouble ( (tags.back()->getTimestamp() - tags.front()->getTimestamp()) / 1000.0 ));
-	meta->set("lasttimestamp", new AMFDouble ( tags.back()->getTimestamp() ));
+	assert ( points.size() == filenames.size() );
 
-	meta->set("metadatacreator", new AMFString("flvtool++ by bramp"));
+	vector<FLVStream *> segments;
+	vector<SegmentWriter *> writers;
 
-	/*
-	// HACK - Remove a bunch of stuff that might be causing problems
-	meta->remove( "audiocodecid" );
-	meta->remove( "audiosamplerate" );
-	meta->remove( "audiosamplesize" );
-	meta->remove( "filesize" );
-	meta->remove( "framerate" );
-	meta->remove( "height" );
-	meta->remove( "width" );
-	meta->remove( "stereo" );
-	meta->remove( "videocodecid" );
-	meta->remove( "videodatarate" );
-	
-	*/
+	// A temporary file spool can't be shared, or opened again
+	if ( input->isStdin() && !input->isMapped() )
+		threads = 1;
+
+	threads = std::max( 1u, std::min( threads, (unsigned int) points.size() ) );
+
+	try {
+		// Making the segments is cheap, it is only the tables, so do it here
+		for ( size_t i = 0; i < points.size(); ++i ) {
+			size_t end = i + 1 < points.size() ? points[i + 1] : tags.size();
+
+			segments.push_back( clipRows( points[i], end ) );
+
+			segments.back()->addMetaData();
+			segments.back()->setPadding( padding );
+			segments.back()->addIndex();
+		}
+
+		for ( unsigned int i = 0; i < threads; ++i ) {
+			writers.push_back( new SegmentWriter( *input, segments, filenames, i, threads ) );
+			writers.back()->start();
+		}
+
+	} catch ( ... ) {
+		for ( size_t i = 0; i < writers.size(); ++i )
+			writers[i]->join();
+
+		for_each( writers.begin(), writers.end(), DeleteObject() );
+		for_each( segments.begin(), segments.end(), DeleteObject() );
+		throw;
+	}
+
+	std::string error;
+
+	for ( size_t i = 0; i < writers.size(); ++i ) {
+		writers[i]->join();
+
+		if ( writers[i]->failed && error.empty() )
+			error = writers[i]->error;
+	}
+
+	for_each( writers.begin(), writers.end(), DeleteObject() );
+	for_each( segments.begin(), segments.end(), DeleteObject() );
+
+	if ( !error.empty() )
+		throw std::runtime_error( error );
 }
 
-void FLVStream::append ( FLVStream &flv ) {
+void FLVStream::setSource ( const InputFile *from, const InputFile *to ) {
+	tags.setSource( from, to );
+}
 
-	unsigned int offset = ~0;
-	bool foundKeyFrame = false;
+size_t FLVStream::seekTime ( unsigned int ms ) const {
+
+	// If the timestamps keep going backwards (eg audio slightly behind video) there are too many runs to be worth it
+	if ( timeRuns.size() > tags.size() / 16 ) {
+		for ( size_t i = 0; i != tags.size(); ++i ) {
+			if ( tags.timestamp(i) >= ms )
+				return i;
+		}
 
-	if ( ownTags ) {
-		throw std::runtime_error( "Current we can't append to a FLVStream that was read from a file! Sorry" );
+		return tags.size();
 	}
 
-	// If we have some tags, we must make sure the new flv has the same specs
-	if ( getTagCount() > 0 ) {
+	for ( size_t r = 0; r != timeRuns.size(); ++r ) {
+		size_t end = r + 1 != timeRuns.size() ? timeRuns[r + 1] : tags.size();
+		size_t i = tags.lowerBound( ms, timeRuns[r], end );
 
-		// Check codecs
-		// TODO Make a option to allow this, because a decode might be able to handle different codecs
-		if ( getVideoCodec() != flv.getVideoCodec() )
-			throw std::runtime_error( "We can't append a stream with a different video codec" );
+		if ( i != end )
+			return i;
+	}
 
-		if ( getAudioCodec() != flv.getAudioCodec() )
-			throw std::runtime_error( "We can't append a stream with a different audio codec" );
+	return tags.size();
+}
 
-		// Check the flv stream has the same video resolution as us
-		if ( getWidth() != flv.getWidth() )
-			throw std::runtime_error( "We can't append a stream with a different video width" );
+// Orders a time before the keyframes after it
+struct KeyFrameAfter {
+	const TagTable &tags;
 
-		if ( getHeight() != flv.getHeight() )
-			throw std::runtime_error( "We can't append a stream with a different video height" );
-		
+	KeyFrameAfter(const TagTable &tags) : tags(tags) {}
+
+	bool operator()(unsigned int ms, size_t row) const {
+		return ms < tags.timestamp(row);
 	}
+};
 
-	// Copy all the tags to append
-	tags_t::iterator i = flv.tags.begin();
-	for ( ; i != flv.tags.end(); ++i ) {
-		Tag *t = (*i);
+size_t FLVStream::keyframeAtOrBefore ( unsigned int ms, size_t before ) const {
 
-		// We don't want to copy meta tags, 
-		if ( t->type() == Tag::Meta ) {
+	typedef vector<size_t>::const_iterator iterator;
+
+	iterator limit = std::lower_bound( keyframeRows.begin(), keyframeRows.end(), before );
+
+	// Search the runs from the last, since we want the last keyframe
+	for ( size_t r = keyframeRuns.size(); r-- != 0; ) {
+		iterator begin = keyframeRows.begin() + keyframeRuns[r];
+		iterator end = r + 1 != keyframeRuns.size() ? keyframeRows.begin() + keyframeRuns[r + 1] : keyframeRows.end();
+
+		if ( begin >= limit )
 			continue;
-		}
 
-		// AND the first video tag must be a keyframe
-		if ( t->type() == Tag::Video ) {
-			VideoTag *vt = static_cast<VideoTag *> ( t );
+		iterator i = std::upper_bound( begin, std::min(end, limit), ms, KeyFrameAfter(tags) );
 
-			if ( vt->getFrameType() == VideoTag::KeyFrame ) {
-				foundKeyFrame = true;
-			} else if ( !foundKeyFrame) {
-				continue;
-			}
-		}
+		if ( i != begin )
+			return *(i - 1);
+	}
 
-		// Work out the correct timestamp offset
-		if (offset == (unsigned int)~0) {
-			offset = end - t->getTimestamp();
-		}
-		
-		t->setTimestamp ( t->getTimestamp() + offset );
+	return tags.size();
+}
+
+void FLVStream::eraseTags ( size_t begin, size_t end ) {
 
-		tags.push_back ( t );
+	// The meta tag might get chopped
+	for ( size_t i = begin; i != end && meta != NULL; ++i ) {
+		if ( tags.flags(i) & TagTable::Object ) {
+			delete meta;
+			meta = NULL;
+		}
 	}
 
-	calculateInformation();
+	tags.erase(begin, end);
+}
+
+off_t FLVStream::tagSize ( size_t i ) const {
+	// The meta tag's length changes as it is edited, so ask it
+	if ( tags.flags(i) & TagTable::Object )
+		return (off_t)meta->size();
+
+	return tags.size(i);
+}
+
+MetaTag *FLVStream::getMetaTag() {
+	
+	// If we don't have a meta tag then create one
+	if ( meta == NULL ) {
+		meta = new MetaTag("onMetaData");
+		
+		// Place this meta tag at the beginning
+		tags.insert( 0, *meta, TagTable::Object );
+
+		// Which moves every keyframe and run along one row (the first run now starts with the meta tag)
+		for ( vector<size_t>::iterator i = keyframeRows.begin(); i != keyframeRows.end(); ++i )
+			++(*i);
+
+		for ( size_t r = 1; r < timeRuns.size(); ++r )
+			++timeRuns[r];
+
+		if ( timeRuns.empty() )
+			timeRuns.push_back( 0 );
+	}
+
+	return meta;
+}
+
+/**
+	Walks the rows of a stream in the order save writes them out, as a series of steps: the meta data tag,
+	the header of a modified row, or a run of input to copy. Adjacent unmodified tags are copied in one run.
+	The same walk gives a ReadAhead the runs in the order save copies them
+*/
+class SaveSteps : public ReadAhead::Runs {
+
+	public:
+
+		enum Step {
+			Done,
+			Object,
+			Header,
+			Copy,
+		};
+
+		// The row of a Header step, and the run of a Copy step
+		size_t row;
+		const InputFile *in;
+		off_t start;
+		off_t len;
+
+		SaveSteps(const TagTable &tags) : row(0), in(NULL), start(0), len(0), tags(tags), nextRow(0), headerDone(false), run(NULL), runStart(0), runEnd(0) {}
+
+		Step next() {
+
+			while ( nextRow < tags.size() ) {
+				size_t i = nextRow;
+
+				// The meta tag is written out in full
+				if ( tags.flags(i) & TagTable::Object ) {
+					if ( endRun() )
+						return Copy;
+
+					nextRow++;
+					return Object;
+				}
+
+				const InputFile *rowIn = tags.source(i);
+				off_t rowStart = tags.filepos(i);
+
+				// If the header has changed, write it, and only copy the data and prev_length
+				if ( tags.flags(i) & TagTable::Modified ) {
+					if ( !headerDone ) {
+						if ( endRun() )
+							return Copy;
+
+						headerDone = true;
+						row = i;
+						return Header;
+					}
+
+					rowStart += Tag::TAGHEADERLEN;
+				}
+
+				headerDone = false;
+				nextRow++;
+
+				bool ended = false;
+
+				if ( run != rowIn || runEnd != rowStart ) {
+					ended = endRun();
+					run = rowIn;
+					runStart = rowStart;
+				}
+
+				runEnd = tags.filepos(i) + tags.size(i);
+
+				if ( ended )
+					return Copy;
+			}
+
+			if ( endRun() )
+				return Copy;
+
+			return Done;
+		}
+
+		bool next(const InputFile * &runIn, off_t &runStart, off_t &runLen) {
+			Step s;
+
+			while ( (s = next()) != Done ) {
+				if ( s == Copy ) {
+					runIn = in;
+					runStart = start;
+					runLen = len;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+	private:
+
+		const TagTable &tags;
+
+		size_t nextRow;
+
+		// Set once the header of nextRow has been written
+		bool headerDone;
+
+		// The run of input not yet copied
+		const InputFile *run;
+		off_t runStart;
+		off_t runEnd;
+
+		// Makes the run (if there is one) the step to copy, returns false if there isn't one
+		bool endRun() {
+			if ( run == NULL )
+				return false;
+
+			in = run;
+			start = runStart;
+			len = runEnd - runStart;
+			run = NULL;
+			return true;
+		}
+};
+
+void FLVStream::save ( const char * filename ) {
+
+	assert ( filename != NULL );
+	assert ( strlen( filename ) > 0 );
+
+	double began = wall_seconds();
+
+	OutputFile out ( filename );
+	FILE *fp = out.file();
+
+	// Write out the FLV header
+	header->write(fp);
+
+	SaveSteps steps ( tags );
+
+	// The reader walks its own copy of the steps, to know which runs we will copy next
+	auto_ptr<SaveSteps> readSteps;
+	auto_ptr<ReadAhead> reader;
+
+	if ( readDepth > 0 && ReadAhead::available() ) {
+		readSteps.reset ( new SaveSteps( tags ) );
+		reader.reset ( new ReadAhead( *readSteps, readDepth, readBuffer ) );
+	}
+
+	SaveSteps::Step s;
+
+	while ( (s = steps.next()) != SaveSteps::Done ) {
+		switch ( s ) {
+			case SaveSteps::Object:
+				meta->write(fp);
+				break;
+
+			case SaveSteps::Header:
+				tags.writeHeader(fp, steps.row);
+				break;
+
+			case SaveSteps::Copy:
+				if ( reader.get() != NULL )
+					reader->copy( out, steps.len );
+				else
+					out.copy( *steps.in, steps.start, steps.len );
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	// Wait for the reader before the table it walks goes
+	reader.reset();
+
+	if ( fflush(fp) )
+		throw vargs_exception( "%s:%d: fflush failed errno(%d)", __FILE__, __LINE__, errno);
+
+	if ( sidecar )
+		saveSidecar( meta, filename, fp );
+
+	savedBytes = out.copied();
+	saveSeconds = wall_seconds() - began;
+}
+
+void FLVStream::setReadAhead ( size_t depth, size_t buflen ) {
+	assert ( buflen > 0 );
+
+	readDepth = depth;
+	readBuffer = buflen;
+}
+
+void FLVStream::setPadding ( size_t padding ) {
+	getMetaTag()->setPadding( padding );
+}
+
+bool FLVStream::keepMetaSize ( ) {
+	if ( meta == NULL || meta->in == NULL )
+		return false;
+
+	meta->keepLength();
+	return true;
+}
+
+bool FLVStream::saveInPlace ( ) {
+
+	if ( input.get() == NULL || meta == NULL || meta->in != input.get() )
+		return false;
+
+	// Every tag must still be where it is in the file, and the meta data tag can't have grown into the next
+	off_t pos = header->size();
+
+	for ( size_t i = 0; i < tags.size(); ++i) {
+
+		if ( tags.flags(i) & TagTable::Object ) {
+			if ( meta->filepos != pos )
+				return false;
+
+		} else if ( tags.source(i) != input.get() || tags.filepos(i) != pos || (tags.flags(i) & TagTable::Modified) ) {
+			return false;
+		}
+
+		pos += tagSize(i);
+	}
+
+	// stdin can't be written back to
+	if ( pos != input->size() || input->isStdin() )
+		return false;
+
+	FILE *fp = fopen(input->name(), "r+b");
+
+	if (fp == NULL)
+		throw vargs_exception("Error %d opening file '%s' for update\n", errno, input->name());
+
+	try {
+		header->write(fp);
+
+		if (fseeko(fp, meta->filepos, SEEK_SET))
+			throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno);
+
+		meta->write(fp);
+
+	} catch (...) {
+		fclose(fp);
+		throw;
+	}
+
+	if (fclose(fp))
+		throw vargs_exception("Error %d updating file '%s'\n", errno, input->name());
+
+	// The file is the same size, since only the meta data tag changed
+	if ( sidecar )
+		KeyFrameIndex ( meta ).save( KeyFrameIndex::filename( input->name() ).c_str(), input->size() );
+
+	return true;
+}
+
+size_t FLVStream::findKeyFrames ( vector<double> & keyFramesBytes, vector<double> & keyFramesTimes ) {
+	
+	keyFramesBytes.clear();
+	keyFramesBytes.reserve ( this->keyframes );
+
+	keyFramesTimes.clear();
+	keyFramesTimes.reserve ( this->keyframes );
+
+	off_t offset = header->size();
+	size_t first = ~0;
+
+	for ( size_t i = 0; i < tags.size(); ++i) {
+
+		// Skip over the meta tag, since its size isn't known yet
+		if ( tags.flags(i) & TagTable::Object ) {
+			first = keyFramesBytes.size();
+			continue;
+		}
+
+		if ( tags.isKeyFrame(i) ) {
+			keyFramesTimes.push_back( tags.timestamp(i) / 1000.00 );
+			keyFramesBytes.push_back( (double) offset );
+		}
+
+		offset += tagSize(i);
+	}
+
+	assert ( keyFramesBytes.size() == keyFramesTimes.size() );
+
+	return std::min( first, keyFramesBytes.size() );
+}
+
+// Places the keyframe index into the meta tag. The byte positions from first onwards are after
+// the meta tag, and were found as if it was base bytes long. Every AMF double is the same size,
+// so once the arrays are in the meta tag its final size is known, and those positions can be moved along.
+static void setKeyFrames ( MetaTag *meta, vector<double> & keyFramesBytes, vector<double> & keyFramesTimes, size_t first, off_t base ) {
+
+	AMFDoubleArray *times = new AMFDoubleArray();
+	AMFDoubleArray *bytes = new AMFDoubleArray();
+
+	times->v.swap( keyFramesTimes );
+	bytes->v.swap( keyFramesBytes );
+
+	AMFObject *o = new AMFObject();
+
+	o->set( "times", times );
+	o->set( "filepositions", bytes );
+
+	meta->set("keyframes", o);
+
+	double shift = (double) ( (off_t)meta->size() - base );
+
+	vector<double>::iterator i = bytes->v.begin() + first;
+
+	for ( ; i != bytes->v.end(); ++i )
+		*i += shift;
+}
+
+void FLVStream::addIndex ( ) {
+	
+	// Get the meta tag first ( to ensure it exists )
+	MetaTag *meta = this->getMetaTag();
+
+	// Two arrays to hold the byte pos of each keyframe, as well as the keyframes timestamp
+	vector<double> keyFramesBytes;
+	vector<double> keyFramesTimes;
+
+	// Find all the keyframes and add them into these array
+	size_t first = findKeyFrames ( keyFramesBytes, keyFramesTimes );
+
+	// Place the keyframes into the metadata struct
+	setKeyFrames ( meta, keyFramesBytes, keyFramesTimes, first, 0 );
+}
+
+// Sets the meta data fields we add, from the first and last timestamps
+static void setMetaData ( MetaTag *meta, unsigned long start, unsigned long end ) {
+	meta->set("duration", new AMFDouble ( (end - start) / 1000.0 ));
+	meta->set("lasttimestamp", new AMFDouble ( end ));
+
+	meta->set("metadatacreator", new AMFString("flvtool++ by bramp"));
+}
+
+void FLVStream::addMetaData ( ) {
+	MetaTag *meta = this->getMetaTag();
+
+	// Now add some extra fields
+	setMetaData ( meta, tags.timestamp( 0 ), tags.timestamp( tags.size() - 1 ) );
+
+	/*
+	// HACK - Remove a bunch of stuff that might be causing problems
+	meta->remove( "audiocodecid" );
+	meta->remove( "audiosamplerate" );
+	meta->remove( "audiosamplesize" );
+	meta->remove( "filesize" );
+	meta->remove( "framerate" );
+	meta->remove( "height" );
+	meta->remove( "width" );
+	meta->remove( "stereo" );
+	meta->remove( "videocodecid" );
+	meta->remove( "videodatarate" );
+	
+	*/
+}
+
+void FLVStream::append ( FLVStream &flv ) {
+
+	unsigned int offset = ~0;
+	bool foundKeyFrame = false;
+
+	size_t first = tags.size();
+
+	// If we have some tags, we must make sure the new flv has the same specs
+	if ( getTagCount() > 0 ) {
+
+		// Check codecs
+		// TODO Make a option to allow this, because a decode might be able to handle different codecs
+		if ( getVideoCodec() != flv.getVideoCodec() )
+			throw std::runtime_error( "We can't append a stream with a different video codec" );
+
+		if ( getAudioCodec() != flv.getAudioCodec() )
+			throw std::runtime_error( "We can't append a stream with a different audio codec" );
+
+		// Check the flv stream has the same video resolution as us
+		if ( getWidth() != flv.getWidth() )
+			throw std::runtime_error( "We can't append a stream with a different video width" );
+
+		if ( getHeight() != flv.getHeight() )
+			throw std::runtime_error( "We can't append a stream with a different video height" );
+		
+	}
+
+	// Copy all the tags to append
+	for ( size_t i = 0; i < flv.tags.size(); ++i ) {
+
+		// We don't want to copy meta tags, 
+		if ( flv.tags.type(i) == Tag::Meta ) {
+			continue;
+		}
+
+		// AND the first video tag must be a keyframe
+		if ( flv.tags.type(i) == Tag::Video ) {
+			if ( flv.tags.isKeyFrame(i) ) {
+				foundKeyFrame = true;
+			} else if ( !foundKeyFrame) {
+				continue;
+			}
+		}
+
+		// Work out the correct timestamp offset
+		if (offset == (unsigned int)~0) {
+			offset = end - flv.tags.timestamp(i);
+		}
+		
+		tags.push_back ( flv.tags, i );
+		tags.setTimestamp ( tags.size() - 1, flv.tags.timestamp(i) + offset );
+	}
+
+	// Only the new tags need adding to our information, so joining many files doesn't go over the same tags again
+	if ( tags.empty() )
+		return;
+
+	if ( first == 0 )
+		start = tags.timestamp( 0 );
+
+	end = tags.timestamp( tags.size() - 1 );
+
+	for ( size_t i = first; i < tags.size(); ++i )
+		addTagInformation( i );
+
+	header->setAudio( audiotags > 0 );
+	header->setVideo( videotags > 0 );
+}
+
+void FLVStream::closeFile() const {
+	if ( input.get() != NULL )
+		input->close();
+}
+
+/**
+	Parses some of the files to join, and closes each once it is parsed
+*/
+class JoinParser : public Thread {
+
+	public:
+
+		// The first file that went wrong (or ~0), and why
+		size_t failed;
+		std::string error;
+
+		JoinParser(const vector<std::string> &filenames, vector<FLVStream *> &streams, InputFile::Mode mode, unsigned int threads, size_t first, size_t step)
+			: failed(~0), filenames(filenames), streams(streams), mode(mode), threads(threads), first(first), step(step) {}
+
+	protected:
+
+		virtual void run();
+
+	private:
+
+		const vector<std::string> &filenames;
+		vector<FLVStream *> &streams;
+
+		InputFile::Mode mode;
+		unsigned int threads;
+
+		// This parser does the files first, first + step, first + 2 * step, etc
+		size_t first;
+		size_t step;
+};
+
+void JoinParser::run() {
+
+	for ( size_t i = first; i < filenames.size(); i += step ) {
+		try {
+			streams[i] = new FLVStream( filenames[i].c_str(), ~0, false, mode, threads );
+			streams[i]->closeFile();
+
+		} catch ( const std::runtime_error &e ) {
+			failed = i;
+			error = e.what();
+			return;
+		}
+	}
+}
+
+FLVJoiner::FLVJoiner(const vector<std::string> &filenames, InputFile::Mode mode, unsigned int threads) {
+
+	const size_t n = filenames.size();
+
+	inputs.resize( n, (FLVStream *)NULL );
+
+	// A thread per file (as many as we can), and any left over help parse the files
+	unsigned int parsers = (unsigned int) std::max( (size_t)1, std::min( (size_t)threads, n ) );
+	unsigned int each = std::max( 1u, threads / parsers );
+
+	vector<JoinParser *> workers;
+
+	try {
+		for ( unsigned int i = 0; i < parsers; ++i ) {
+			workers.push_back( new JoinParser( filenames, inputs, mode, each, i, parsers ) );
+			workers.back()->start();
+		}
+
+		size_t failed = ~0;
+		std::string error;
+
+		for ( size_t i = 0; i < workers.size(); ++i ) {
+			workers[i]->join();
+
+			if ( workers[i]->failed < failed ) {
+				failed = workers[i]->failed;
+				error = workers[i]->error;
+			}
+		}
+
+		if ( failed != (size_t)~0 )
+			throw std::runtime_error( error );
+
+		// Now join them in order
+		for ( size_t i = 0; i < n; ++i )
+			out.append( *inputs[i] );
+
+	} catch ( ... ) {
+		for ( size_t i = 0; i < workers.size(); ++i )
+			workers[i]->join();
+
+		for_each( workers.begin(), workers.end(), DeleteObject() );
+		for_each( inputs.begin(), inputs.end(), DeleteObject() );
+		throw;
+	}
+
+	for_each( workers.begin(), workers.end(), DeleteObject() );
+}
+
+FLVJoiner::~FLVJoiner() {
+	for_each( inputs.begin(), inputs.end(), DeleteObject() );
+}
+
+FLVIndexer::FLVIndexer(const char *filename, InputFile::Mode mode)
+	: metaStart(0), metaEnd(0), dataEnd(0), tagcount(0), start(0), end(0),
+		readDepth(0), readBuffer(ReadAhead::DEFAULT_BUFFER_LEN), savedBytes(0), saveSeconds(0), sidecar(false) {
+
+	input.reset ( new InputFile( filename, mode ) );
+
+	scan();
+}
+
+void FLVIndexer::scan() {
+
+	auto_ptr<ByteReader> r ( input->reader() );
+	ByteReader &reader = *r;
+
+	header.reset ( new TagHeader ( reader ) );
+
+	// The whole file is read through, so keep reads of it in flight (with --io-uring)
+	reader.readAhead( input->size() );
+
+	while ( true ) {
+		off_t pos = reader.tell();
+
+		auto_ptr<Tag> tag ( fread_Tag(reader) );
+
+		if ( tag.get() == NULL )
+			break;
+
+		if ( tagcount == 0 )
+			start = tag->getTimestamp();
+
+		end = tag->getTimestamp();
+		tagcount++;
+		dataEnd = reader.tell();
+
+		if ( tag->type() == Tag::Video ) {
+			const VideoTag *v = static_cast<const VideoTag*> ( tag.get() );
+
+			if ( v->getFrameType() == VideoTag::KeyFrame ) {
+				keyFramesTimes.push_back( v->getTimestamp() / 1000.00 );
+				keyFramesBytes.push_back( (double) pos );
+			}
+
+		} else if ( tag->type() == Tag::Meta && meta.get() == NULL ) {
+			meta.reset( static_cast<MetaTag *> ( tag.release() ) );
+			metaStart = pos;
+			metaEnd = reader.tell();
+		}
+	}
+
+	// If there is no meta data tag, a new one goes at the beginning
+	if ( meta.get() == NULL ) {
+		meta.reset( new MetaTag("onMetaData") );
+		metaStart = header->size();
+		metaEnd = header->size();
+
+		// And is at 0ms, so the duration is from 0 (as FLVStream::getMetaTag does)
+		start = 0;
+	}
+
+	if ( dataEnd < metaEnd )
+		dataEnd = metaEnd;
+}
+
+void FLVIndexer::addMetaData ( ) {
+	setMetaData ( meta.get(), start, end );
+}
+
+void FLVIndexer::setPadding ( size_t padding ) {
+	meta->setPadding( padding );
+}
+
+void FLVIndexer::addIndex ( ) {
+
+	// The keyframes after the meta data tag (at or after metaEnd)
+	size_t first = std::lower_bound( keyFramesBytes.begin(), keyFramesBytes.end(), (double) metaEnd ) - keyFramesBytes.begin();
+
+	// Copies, because addIndex can be called more than once
+	vector<double> bytes ( keyFramesBytes );
+	vector<double> times ( keyFramesTimes );
+
+	setKeyFrames ( meta.get(), bytes, times, first, metaEnd - metaStart );
+}
+
+/**
+	The two runs FLVIndexer::save copies, either side of the meta data tag
+*/
+class IndexerRuns : public ReadAhead::Runs {
+
+	public:
+
+		IndexerRuns(const InputFile &in, off_t dataStart, off_t metaStart, off_t metaEnd, off_t dataEnd)
+			: in(in), count(0) {
+			starts[0] = dataStart;
+			ends[0] = metaStart;
+			starts[1] = metaEnd;
+			ends[1] = dataEnd;
+		}
+
+		bool next(const InputFile * &runIn, off_t &start, off_t &len) {
+			if ( count == 2 )
+				return false;
+
+			runIn = &in;
+			start = starts[count];
+			len = ends[count] - starts[count];
+			count++;
+			return true;
+		}
+
+	private:
+
+		const InputFile &in;
+		off_t starts[2];
+		off_t ends[2];
+		unsigned int count;
+};
+
+void FLVIndexer::save ( const char *filename ) {
+
+	assert ( filename != NULL );
+	assert ( strlen( filename ) > 0 );
+
+	double began = wall_seconds();
+
+	OutputFile out ( filename );
+
+	header->write( out.file() );
+
+	// Everything is copied, apart from the meta data tag which is replaced
+	IndexerRuns runs ( *input, header->size(), metaStart, metaEnd, dataEnd );
+	auto_ptr<ReadAhead> reader;
+
+	if ( readDepth > 0 && ReadAhead::available() )
+		reader.reset ( new ReadAhead( runs, readDepth, readBuffer ) );
+
+	if ( reader.get() != NULL )
+		reader->copy( out, metaStart - header->size() );
+	else
+		out.copy( *input, header->size(), metaStart - header->size() );
+
+	meta->write( out.file() );
+
+	if ( reader.get() != NULL )
+		reader->copy( out, dataEnd - metaEnd );
+	else
+		out.copy( *input, metaEnd, dataEnd - metaEnd );
+
+	reader.reset();
+
+	if ( fflush( out.file() ) )
+		throw vargs_exception( "%s:%d: fflush failed errno(%d)", __FILE__, __LINE__, errno);
+
+	if ( sidecar )
+		saveSidecar( meta.get(), filename, out.file() );
+
+	savedBytes = out.copied();
+	saveSeconds = wall_seconds() - began;
+}
+
+void FLVIndexer::setReadAhead ( size_t depth, size_t buflen ) {
+	assert ( buflen > 0 );
+
+	readDepth = depth;
+	readBuffer = buflen;
+}
+
+FLVProbe::FLVProbe(const char *filename, InputFile::Mode mode)
+	: videocodec(VideoTag::Undefined), audiocodec(AudioTag::Undefined), width(0), height(0), start(0), end(0) {
+
+	input.reset ( new InputFile( filename, mode ) );
+
+	auto_ptr<ByteReader> r ( input->reader() );
+
+	header.reset ( new TagHeader ( *r ) );
+
+	off_t first = r->tell();
+	off_t last = first;
+
+	// Read the first few tags
+	for ( unsigned int i = 0; i < FIRST_TAGS; i++ ) {
+		auto_ptr<Tag> tag ( fread_Tag(*r) );
+
+		if ( tag.get() == NULL )
+			break;
+
+		if ( i == 0 )
+			start = tag->getTimestamp();
+
+		end = tag->getTimestamp();
+		last = r->tell();
+
+		addTag( tag.release() );
+	}
+
+	// If that was the whole file, we are done
+	if ( last == input->size() )
+		return;
+
+	// Otherwise walk backwards from the end, each tag is followed by its length
+	off_t pos = input->size();
+
+	for ( unsigned int i = 0; i < LAST_TAGS && pos > last; i++ ) {
+		unsigned char b[4];
+
+		if ( pos - 4 < last )
+			throw std::runtime_error("the end of the file is damaged");
+
+		input->read(pos - 4, b, 4);
+
+		off_t size = (off_t) ( (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3] );
+		off_t tagpos = pos - 4 - size;
+
+		if ( size < Tag::TAGHEADERLEN || tagpos < last )
+			throw std::runtime_error("the end of the file is damaged");
+
+		// fread_Tag checks the length after the tag matches
+		auto_ptr<ByteReader> t ( input->reader() );
+		t->skip( tagpos );
+
+		auto_ptr<Tag> tag ( fread_Tag(*t) );
+
+		if ( tag.get() == NULL || t->tell() != pos )
+			throw std::runtime_error("the end of the file is damaged");
+
+		if ( i == 0 )
+			end = tag->getTimestamp();
+
+		addTag( tag.release() );
+
+		pos = tagpos;
+	}
+}
+
+void FLVProbe::addTag(Tag *t) {
+
+	auto_ptr<Tag> tag ( t );
+
+	switch ( tag->type() ) {
+		case Tag::Audio: {
+			if ( audiocodec == AudioTag::Undefined )
+				audiocodec = static_cast<AudioTag *>( tag.get() )->getCodec();
+
+			break;
+		}
+		case Tag::Video: {
+			const VideoTag *v = static_cast<VideoTag *>( tag.get() );
+
+			if ( v->getFrameType() == VideoTag::KeyFrame ) {
+				if ( width == 0 || height == 0 ) {
+					width = v->getWidth();
+					height = v->getHeight();
+				}
+
+				if ( videocodec == VideoTag::Undefined )
+					videocodec = v->getCodec();
+			}
+
+			break;
+		}
+		case Tag::Meta: {
+			if ( meta.get() == NULL )
+				meta.reset( static_cast<MetaTag *>( tag.release() ) );
+
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void FLVProbe::printInfo( std::ostream &out ) const {
+	double startd = start / 1000.00;
+	double endd = end / 1000.00;
+
+	out << header.get() << endl;
+
+	if ( meta.get() != NULL )
+		out << meta.get() << endl;
+
+	out.precision(4);
+	out << "Stream Info (fast)" << endl;
+	out << "Video codec: " << videocodec << ", Audio codec: " << audiocodec << ", Dimensions: " << width << "x" << height << endl;
+	out << "Start: " << startd << "s, End: " << endd << "s, Duration: " << (endd - startd) << "s" << endl;
 }
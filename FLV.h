@@ -7,9 +7,17 @@
 	If you wish to use this product for commercial reasons, then please contact us
 */
 
+#ifndef _FLV_H_
+#define _FLV_H_
+
 #include "Tag.h"
+#include "TagTable.h"
 
+#include <iostream>
 #include <memory>
+#include <string>
+#include <vector>
+#include <utility>
 
 /**
 	Class to represent a FLV file/stream
@@ -17,24 +25,22 @@
 
 class FLVStream {
 
+	friend class ScanCache;
+
 	protected:
 
-		// The filehandle associated with this stream
-		FILE *fp;
+		// The file associated with this stream
+		std::auto_ptr<InputFile> input;
 
 		// The stream's header
 		std::auto_ptr<TagHeader> header;
 
 		// The meta data tag, we assume there is only one (and we use the first we encounter)
+		// This is the only tag kept as a object, its row in the table is marked TagTable::Object
 		MetaTag *meta;
 
-		// Maps stream position (in bytes) to Tags
-		typedef std::vector<Tag *> tags_t;
-		tags_t tags;
-		
-		// Hack, when appending tags into this FLVStream, they are still owned by the original FLVStream
-		// Thus some may be double deleted! This boolean option decides whether we own ALL the tags
-		bool ownTags;
+		// All the tags in stream order
+		TagTable tags;
 
 		// Some vars to record all sorts of information
 		unsigned int audiotags;
@@ -44,6 +50,14 @@ class FLVStream {
 
 		unsigned int keyframes;
 
+		// The row of each keyframe, in stream order
+		std::vector<size_t> keyframeRows;
+
+		// Timestamps can go backwards (eg when they wrap), so time lookups binary search each run that doesn't
+		// These are the rows each run starts at, and the same for keyframeRows (as positions in it)
+		std::vector<size_t> timeRuns;
+		std::vector<size_t> keyframeRuns;
+
 		VideoTag::Codec videocodec;
 		AudioTag::Codec audiocodec;
 
@@ -56,23 +70,55 @@ class FLVStream {
 		// End time in ms
 		unsigned long end;
 
-		// Helper method that just finds the keyframes and creates some indexes
-		void findKeyFrames ( std::vector<off_t> & keyFramesBytes, std::vector<double> & keyFramesTimes );
+		// The junk skipped over when recovering a damaged file, as (offset, length) pairs
+		std::vector< std::pair<off_t, off_t> > skipped;
+
+		// How save reads ahead of its writes (see setReadAhead)
+		size_t readDepth;
+		size_t readBuffer;
+
+		// How many bytes of tag data the last save copied, and how long it took
+		off_t savedBytes;
+		double saveSeconds;
+
+		// If save writes a KeyFrameIndex beside each file (see setSidecar)
+		bool sidecar;
+
+		// Helper method that just finds the keyframes and creates some indexes. The byte
+		// positions leave out the meta tag, returns how many keyframes come before it
+		size_t findKeyFrames ( std::vector<double> & keyFramesBytes, std::vector<double> & keyFramesTimes );
 
 		// Loads the filename, and goes no futher than end
-		void init(const char* filename, unsigned long end, bool verbose);
+		void init(const char* filename, unsigned long end, bool verbose, InputFile::Mode mode, unsigned int threads, bool recover);
 
 		// Prints the frames from begin to end
-		void printFrames(tags_t::const_iterator begin, tags_t::const_iterator end) const;
+		void printFrames(size_t begin, size_t end) const;
 
 		// Counts how many tags, we have, and records other information
 		void calculateInformation();
-		inline void addTagInformation(const Tag & tag );
+
+		// Records information about row i, tag is the full tag if we already have it
+		inline void addTagInformation(size_t i, const Tag *tag = NULL );
+
+		// Removes the rows from begin to end (deleting the meta tag if it is one of them)
+		void eraseTags ( size_t begin, size_t end );
+
+		// Size of row i once written out
+		off_t tagSize ( size_t i ) const;
+
+		// Returns a new stream of the rows from startTag up to endTag, see clip
+		FLVStream *clipRows ( size_t startTag, size_t endTag ) const;
+
+		// Finds the rows crop would keep, from startTag up to endTag, and moves start back to the keyframe
+		void cropRange ( unsigned int &start, unsigned int end, size_t &startTag, size_t &endTag ) const;
 
 	public:
 
 		// Constructs a new FLV Stream from a file, but doesn't read past end, and prints out tag information
-		FLVStream(const char *filename = NULL, unsigned long end = ~0, bool verbose = false);
+		// The file is either read with stdio, or mapped into memory
+		// Large files are read by up to threads threads at once
+		// If recover is set, anything that isn't a tag is skipped over, instead of being a error
+		FLVStream(const char *filename = NULL, unsigned long end = ~0, bool verbose = false, InputFile::Mode mode = InputFile::Stdio, unsigned int threads = 1, bool recover = false);
 
 		~FLVStream();
 
@@ -85,12 +131,40 @@ class FLVStream {
 		// Append the argument on to the end of this stream
 		void append ( FLVStream &flv );
 
+		// Closes our file until it is next needed (see InputFile::close)
+		void closeFile() const;
+
 		// Crop this stream at the start and end timestamps 
 		void crop ( unsigned int start, unsigned int end );
 
-		// Prints to stdout information about this stream
+		// Returns a new stream of the tags crop would keep, which reads from our file, so we must outlive it
+		// The meta data tag (if kept) is read again from the file
+		FLVStream *clip ( unsigned int start, unsigned int end ) const;
+
+		// Writes each clip (from clip) out to its filename, in one pass over our file, so clips that overlap share the reads
+		void saveClips ( const std::vector<FLVStream *> &clips, const std::vector<std::string> &filenames ) const;
+
+		// Returns the rows to split this stream at, so each segment starts with a keyframe and is about interval ms long
+		// The first is always row 0, and if interval is 0 there are no other segments
+		std::vector<size_t> splitPoints ( unsigned int interval ) const;
+
+		// Splits this stream into a segment starting at each of the points (from splitPoints), with its own
+		// timestamps, meta data (with padding bytes spare) and index. The segments are written to filenames
+		// by up to threads threads at once, each with its own handle on our file
+		void split ( const std::vector<size_t> &points, const std::vector<std::string> &filenames, size_t padding, unsigned int threads ) const;
+
+		// Moves the tags read from one file over to reading the same tags from another (ie the same file opened again)
+		void setSource ( const InputFile *from, const InputFile *to );
+
+		// Returns the first tag at or after ms (or getTagCount() if there isn't one)
+		size_t seekTime ( unsigned int ms ) const;
+
+		// Returns the last keyframe at or before ms, out of the tags before row before (or getTagCount() if there isn't one)
+		size_t keyframeAtOrBefore ( unsigned int ms, size_t before = (size_t)~0 ) const;
+
+		// Prints information about this stream, the frames to stdout
 		void printFrames() const;
-		void printInfo() const;
+		void printInfo( std::ostream &out = std::cout ) const;
 
 		// Returns the duration in milliseconds
 		unsigned int duration() const { return end - start; }
@@ -98,6 +172,31 @@ class FLVStream {
 		// Write this FLV file out to the filename
 		void save ( const char *filename );
 
+		// Makes save read the tag data depth buffers of buflen bytes ahead of writing it, in another thread,
+		// which helps when the input and output are on different disks. With a depth of 0 (the default) save
+		// reads and writes in turn, but large copies are done in the kernel
+		void setReadAhead ( size_t depth, size_t buflen );
+
+		// How many bytes of tag data the last save copied, and how many seconds it took
+		off_t getSavedBytes() const { return savedBytes; };
+		double getSaveSeconds() const { return saveSeconds; };
+
+		// Makes every save (and saveInPlace, split and saveClips) also write a binary index of the keyframes
+		// beside the file, for seek servers (see KeyFrameIndex). It is off by default
+		void setSidecar ( bool on ) { sidecar = on; };
+
+		// Leaves padding bytes spare in the meta data tag, so later changes can be saved in place
+		// This moves the tags, so call it before addIndex
+		void setPadding ( size_t padding );
+
+		// Keeps the meta data tag the size it is in the file (or bigger), so saveInPlace can overwrite it
+		// Call this before changing the meta data, returns false if the file has no meta data tag
+		bool keepMetaSize ( );
+
+		// Writes the header and meta data tag back over the file we were read from, without touching the other tags
+		// Returns false (and writes nothing) if the tags have moved, or the meta data tag no longer fits
+		bool saveInPlace ( );
+
 		// Returns the metadata tag (if there isn't one create it!
 		MetaTag *getMetaTag();
 
@@ -118,4 +217,153 @@ class FLVStream {
 		AudioTag::Codec getAudioCodec() const { return audiocodec; };
 
 		unsigned int getTagCount() const { return (unsigned int) tags.size(); };
+
+		// The junk skipped over while recovering, as (offset, length) pairs
+		const std::vector< std::pair<off_t, off_t> > & getSkipped() const { return skipped; };
 };
+
+/**
+	Indexes a FLV file in two sequential passes, without keeping any table of tags.
+	The first pass finds the keyframes and the meta data tag, the second writes the
+	header and the new meta data tag, and copies everything else straight through.
+	Memory use is just the keyframe arrays, no matter how many tags there are.
+	The output is the same as FLVStream's addMetaData, addIndex, save
+*/
+class FLVIndexer {
+
+	protected:
+
+		std::auto_ptr<InputFile> input;
+
+		std::auto_ptr<TagHeader> header;
+
+		// The first meta data tag in the file (or a new one)
+		std::auto_ptr<MetaTag> meta;
+
+		// Where the meta data tag is in the input (both header->size() if it is new)
+		off_t metaStart;
+		off_t metaEnd;
+
+		// The end of the last whole tag, anything after it is not copied
+		off_t dataEnd;
+
+		// The position in the input, and timestamp in seconds of each keyframe
+		std::vector<double> keyFramesBytes;
+		std::vector<double> keyFramesTimes;
+
+		unsigned int tagcount;
+
+		// First and last timestamps in ms
+		unsigned long start;
+		unsigned long end;
+
+		// See FLVStream
+		size_t readDepth;
+		size_t readBuffer;
+
+		off_t savedBytes;
+		double saveSeconds;
+
+		bool sidecar;
+
+		// The first pass over the file
+		void scan();
+
+	public:
+
+		// Reads the file through once
+		FLVIndexer(const char *filename, InputFile::Mode mode = InputFile::Stdio);
+
+		// The same as the FLVStream methods
+		void addMetaData ( );
+		void setPadding ( size_t padding );
+		void addIndex ( );
+
+		// Writes the new file out, the second pass over the input
+		void save ( const char *filename );
+
+		// The same as the FLVStream methods
+		void setReadAhead ( size_t depth, size_t buflen );
+		off_t getSavedBytes() const { return savedBytes; };
+		double getSaveSeconds() const { return saveSeconds; };
+		void setSidecar ( bool on ) { sidecar = on; };
+
+		unsigned int getTagCount() const { return tagcount; };
+};
+
+/**
+	Joins FLV files into one stream. The files are parsed by several threads at once, and each
+	is closed once parsed, to be opened again (a few at a time) when the joined stream is saved,
+	so any number of files can be joined without running out of file handles
+*/
+class FLVJoiner {
+
+	protected:
+
+		// The files, which must outlive the joined stream since its tags are read from them
+		std::vector<FLVStream *> inputs;
+
+		FLVStream out;
+
+	public:
+
+		// Parses filenames with up to threads threads, and joins them in order
+		FLVJoiner(const std::vector<std::string> &filenames, InputFile::Mode mode = InputFile::Stdio, unsigned int threads = 1);
+
+		~FLVJoiner();
+
+		// The joined stream
+		FLVStream &stream() { return out; };
+};
+
+/**
+	Finds the basic information about a FLV file without reading all of it. The first few
+	tags give the start time, meta data, codecs and dimensions, and since each tag ends with
+	its length, the last few tags can be found by walking backwards from the end of the file
+*/
+class FLVProbe {
+
+	protected:
+
+		std::auto_ptr<InputFile> input;
+
+		std::auto_ptr<TagHeader> header;
+
+		// The first meta data tag (if it is in the first few tags)
+		std::auto_ptr<MetaTag> meta;
+
+		VideoTag::Codec videocodec;
+		AudioTag::Codec audiocodec;
+
+		unsigned int width;
+		unsigned int height;
+
+		// First and last timestamps in ms
+		unsigned long start;
+		unsigned long end;
+
+		// Records what the tag tells us
+		void addTag(Tag *tag);
+
+	public:
+
+		// How many tags are read from the start, and from the end
+		const static unsigned int FIRST_TAGS = 32;
+		const static unsigned int LAST_TAGS = 32;
+
+		// Reads the start and end of the file. Throws if the end of the file is damaged
+		FLVProbe(const char *filename, InputFile::Mode mode = InputFile::Stdio);
+
+		void printInfo( std::ostream &out = std::cout ) const;
+
+		unsigned long getStart() const { return start; };
+		unsigned long getEnd() const { return end; };
+
+		VideoTag::Codec getVideoCodec() const { return videocodec; };
+		AudioTag::Codec getAudioCodec() const { return audiocodec; };
+
+		unsigned int getWidth() const { return width; };
+		unsigned int getHeight() const { return height; };
+};
+
+#endif
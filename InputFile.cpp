@@ -0,0 +1,315 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "InputFile.h"
+#include "ByteReader.h"
+
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef WIN32
+	#include <io.h>
+	#include <fcntl.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+const InputFile *InputFile::head = NULL;
+const InputFile *InputFile::tail = NULL;
+size_t InputFile::reopened = 0;
+Mutex InputFile::reopenLock;
+
+InputFile::InputFile(const char *filename, Mode mode) : filename(filename), fp(NULL), closed(false), prev(NULL), next(NULL), filesize(0), map(NULL), stream(false) {
+
+	assert ( filename != NULL );
+	assert ( strlen( filename ) > 0 );
+
+	if ( isStdin() ) {
+		openStdin(mode);
+
+	} else {
+		fp = open(filename, "rb");
+
+		if (fp == NULL)
+			throw vargs_exception("Error %d opening input file '%s'\n", errno, filename);
+
+		if (fseeko(fp, 0, SEEK_END) || (filesize = ftello(fp)) == -1 || fseeko(fp, 0, SEEK_SET)) {
+			int err = errno;
+			fclose(fp);
+			throw vargs_exception("Error %d finding the size of input file '%s'\n", err, filename);
+		}
+	}
+
+	if (mode == Mmap && map == NULL && fp != NULL)
+		mapFile();
+}
+
+InputFile::~InputFile() {
+#ifndef WIN32
+	if ( map != NULL && spool.empty() )
+		munmap(map, (size_t)filesize);
+#endif
+
+	if ( closed ) {
+		MutexLock lock ( reopenLock );
+
+		if ( fp != NULL ) {
+			unlink();
+			reopened--;
+		}
+	}
+
+	if ( fp != NULL && fp != stdin )
+		fclose(fp);
+}
+
+FILE *InputFile::file() const {
+
+	if ( !closed )
+		return fp;
+
+	MutexLock lock ( reopenLock );
+
+	if ( fp == NULL ) {
+
+		// Make room by closing the least recently used
+		if ( reopened >= MAX_REOPENED )
+			closeLast();
+
+		fp = openLocked(filename.c_str(), "rb");
+
+		if (fp == NULL)
+			throw vargs_exception("Error %d opening input file '%s'\n", errno, name());
+
+		reopened++;
+
+	} else {
+		unlink();
+	}
+
+	pushFront();
+
+	return fp;
+}
+
+void InputFile::close() const {
+
+	// Stdin (or its spool) can't be opened again
+	if ( isStdin() )
+		return;
+
+	MutexLock lock ( reopenLock );
+
+	if ( fp != NULL ) {
+		if ( closed ) {
+			unlink();
+			reopened--;
+		}
+
+		fclose(fp);
+		fp = NULL;
+	}
+
+	closed = true;
+}
+
+FILE *InputFile::open(const char *filename, const char *mode) {
+	MutexLock lock ( reopenLock );
+
+	return openLocked(filename, mode);
+}
+
+FILE *InputFile::openLocked(const char *filename, const char *mode) {
+	FILE *f = fopen(filename, mode);
+
+	// The process may be allowed fewer handles than MAX_REOPENED, so close more until one is free
+	while ( f == NULL && (errno == EMFILE || errno == ENFILE) && tail != NULL ) {
+		closeLast();
+		f = fopen(filename, mode);
+	}
+
+	return f;
+}
+
+void InputFile::closeLast() {
+	const InputFile *last = tail;
+
+	last->unlink();
+	fclose(last->fp);
+	last->fp = NULL;
+	reopened--;
+}
+
+void InputFile::unlink() const {
+	if ( prev != NULL )
+		prev->next = next;
+	else
+		head = next;
+
+	if ( next != NULL )
+		next->prev = prev;
+	else
+		tail = prev;
+
+	prev = NULL;
+	next = NULL;
+}
+
+void InputFile::pushFront() const {
+	prev = NULL;
+	next = head;
+
+	if ( head != NULL )
+		head->prev = this;
+	else
+		tail = this;
+
+	head = this;
+}
+
+void InputFile::openStdin(Mode mode) {
+
+#ifdef WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+
+	fp = stdin;
+
+	// If stdin is a file we can use it as it is
+	if (fseeko(fp, 0, SEEK_END) == 0 && (filesize = ftello(fp)) != -1 && fseeko(fp, 0, SEEK_SET) == 0)
+		return;
+
+	if (errno != ESPIPE)
+		throw vargs_exception("Error %d finding the size of input file '%s'\n", errno, name());
+
+	clearerr(fp);
+
+	// Read it as it arrives
+	if ( mode == Stream ) {
+		stream = true;
+		return;
+	}
+
+	spoolStream();
+}
+
+void InputFile::spoolStream() {
+
+	FILE *in = fp;
+	fp = NULL;
+	filesize = 0;
+
+	std::vector<unsigned char> buf( 64 * 1024 );
+
+	while ( true ) {
+		size_t len = fread(&buf[0], 1, buf.size(), in);
+
+		if ( len == 0 ) {
+			if ( ferror(in) )
+				throw vargs_exception( "%s:%d: fread failed errno(%d)", __FILE__, __LINE__, errno);
+			break;
+		}
+
+		filesize += len;
+
+		if ( fp != NULL ) {
+			fwrite_s(fp, &buf[0], len);
+			continue;
+		}
+
+		spool.insert( spool.end(), buf.begin(), buf.begin() + len );
+
+		// Too big to keep in memory, so move it all into a temporary file
+		if ( spool.size() > SPOOL_MEMORY ) {
+			fp = tmpfile();
+
+			if (fp == NULL)
+				throw vargs_exception("Error %d creating a temporary file to spool '%s'\n", errno, name());
+
+			fwrite_s(fp, &spool[0], spool.size());
+
+			std::vector<unsigned char> empty;
+			spool.swap( empty );
+		}
+	}
+
+	if ( fp != NULL ) {
+		if (fflush(fp) || fseeko(fp, 0, SEEK_SET))
+			throw vargs_exception( "%s:%d: spooling failed errno(%d)", __FILE__, __LINE__, errno);
+
+	} else if ( !spool.empty() ) {
+		// The spool is read just like a mapping
+		map = &spool[0];
+	}
+}
+
+void InputFile::mapFile() {
+#ifndef WIN32
+	// mmap can't map a empty file, and a file bigger than our address space won't fit
+	if (filesize > 0 && (off_t)(size_t)filesize == filesize) {
+		void *m = mmap(NULL, (size_t)filesize, PROT_READ, MAP_SHARED, fileno(fp), 0);
+
+		if (m != MAP_FAILED) {
+			map = (unsigned char *)m;
+
+			// We mostly walk the file from start to end
+			madvise(map, (size_t)filesize, MADV_SEQUENTIAL);
+		}
+	}
+#endif
+}
+
+void InputFile::read(off_t offset, unsigned char *buf, size_t len) const {
+
+	assert ( offset >= 0 );
+
+	if ( map != NULL ) {
+		if ( offset + (off_t)len > filesize )
+			throw std::runtime_error("could not read requested bytes");
+
+		memcpy(buf, map + offset, len);
+		return;
+	}
+
+	FILE *f = file();
+
+	// A empty spool
+	if ( f == NULL || fread_at(f, offset, buf, len) < len )
+		throw std::runtime_error("could not read requested bytes");
+}
+
+const unsigned char *InputFile::data(off_t offset, size_t len) const {
+
+	assert ( offset >= 0 );
+
+	if ( map == NULL )
+		return NULL;
+
+	if ( offset + (off_t)len > filesize )
+		throw std::runtime_error("could not read requested bytes");
+
+	return map + offset;
+}
+
+ByteReader *InputFile::reader() const {
+	ByteReader *r;
+
+	// An empty spool has no memory or file, so gets a reader over nothing
+	FILE *f = map != NULL ? NULL : file();
+
+	if ( f == NULL )
+		r = new ByteReader(map, (size_t)filesize);
+	else
+		r = new ByteReader(f, 0);
+
+	r->setSource(this);
+	r->setSequential(stream);
+	return r;
+}
@@ -0,0 +1,138 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _INPUTFILE_H_
+#define _INPUTFILE_H_
+
+#include "common.h"
+#include "Thread.h"
+
+#include <string>
+#include <vector>
+
+class ByteReader;
+
+/**
+	A FLV file opened for reading. Tags keep a pointer to the InputFile they came
+	from, so they can get at their data again later.
+	The file is either read with stdio, or mapped read-only into memory, in which
+	case tag data is used straight from the mapping with no seek or copy.
+	The filename "-" reads stdin. If stdin can't seek (a pipe), it is spooled,
+	into memory if small enough, otherwise into a temporary file, unless it is
+	opened as a Stream, which is read once from start to end by a single reader
+
+	So that many files can be kept without running out of file handles, a named
+	file can be closed, and is then opened again when it is next needed. Only
+	MAX_REOPENED of those are open at once (fewer if the process runs out of file
+	handles first), the least recently used are closed to make room. A FILE* (or
+	reader) from a closed file may be closed by using another, so closed files
+	should only be used from one thread at a time
+*/
+class InputFile {
+
+	public:
+
+		enum Mode {
+			Stdio,
+			Mmap,
+			Stream, // Same as Stdio, but a pipe isn't spooled, so only one reader() can be used, and nothing read again
+		};
+
+		// Pipes up to this size are spooled into memory, bigger ones into a temporary file
+		const static size_t SPOOL_MEMORY = 32 * 1024 * 1024;
+
+		// How many closed files can be open again at once
+		const static size_t MAX_REOPENED = 64;
+
+		// Opens filename, if Mmap is asked for but not possible we fall back to Stdio
+		InputFile(const char *filename, Mode mode = Stdio);
+
+		~InputFile();
+
+		// Reads len bytes starting at offset into buf, this doesn't move the file position, so many threads can read at once
+		void read(off_t offset, unsigned char *buf, size_t len) const;
+
+		// Returns a pointer to len bytes starting at offset, or NULL if the file is not mapped
+		const unsigned char *data(off_t offset, size_t len) const;
+
+		// Returns a new reader that starts at the beginning of the file
+		ByteReader *reader() const;
+
+		bool isMapped() const { return map != NULL; };
+
+		// Returns NULL if the input was spooled into memory, opens the file again if it was closed
+		FILE *file() const;
+
+		// Closes the file until it is next needed (only named files are closed)
+		void close() const;
+
+		// True if we are reading stdin, rather than a named file
+		bool isStdin() const { return filename == "-"; };
+
+		// The size of the file in bytes (0 for a Stream from a pipe, until it has been read)
+		off_t size() const { return filesize; };
+
+		const char *name() const { return filename.c_str(); };
+
+		// Opens a file like fopen, but if the process is out of file handles, closes the
+		// files that were opened again until it can (so outputs can always be opened)
+		static FILE *open(const char *filename, const char *mode);
+
+	private:
+
+		std::string filename;
+
+		mutable FILE *fp;
+
+		// Set once we have been closed, after which fp is looked after by the list below
+		mutable bool closed;
+
+		// The closed files that are open again, most recently used first
+		static const InputFile *head;
+		static const InputFile *tail;
+		static size_t reopened;
+		static Mutex reopenLock;
+
+		mutable const InputFile *prev;
+		mutable const InputFile *next;
+
+		// Takes us out of (or puts us at the front of) the list of open closed files
+		void unlink() const;
+		void pushFront() const;
+
+		// Closes the least recently used file in the list, which mustn't be empty (hold reopenLock)
+		static void closeLast();
+
+		// open, with reopenLock held
+		static FILE *openLocked(const char *filename, const char *mode);
+
+		off_t filesize;
+
+		// The read-only mapping of the whole file (if we are mapped), or the spool below
+		unsigned char *map;
+
+		// A non-seekable stdin, read into memory
+		std::vector<unsigned char> spool;
+
+		// A non-seekable stdin, read through once instead of spooled
+		bool stream;
+
+		void openStdin(Mode mode);
+
+		// Reads all of the (non-seekable) fp into memory, or a temporary file
+		void spoolStream();
+
+		void mapFile();
+
+		// Not copyable
+		InputFile(const InputFile &);
+		InputFile & operator = (const InputFile &);
+};
+
+#endif
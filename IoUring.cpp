@@ -0,0 +1,272 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "IoUring.h"
+
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef HAVE_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+bool IoUring::wanted = false;
+
+void IoUring::enable(bool on) {
+	wanted = on;
+}
+
+#ifdef HAVE_IO_URING
+
+// glibc has no wrappers for these
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Returns true if the kernel has io_uring, and it can do reads (which came in 5.6)
+static bool probe() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	// Not there, or turned off (with the kernel.io_uring_disabled sysctl, or seccomp)
+	int fd = io_uring_setup(2, &p);
+
+	if ( fd < 0 )
+		return false;
+
+	// The probe came in 5.6, at the same time as reads, so if it fails neither is there
+	std::vector<unsigned char> buf( sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op) );
+	struct io_uring_probe *pr = (struct io_uring_probe *) &buf[0];
+
+	bool ok = io_uring_register(fd, IORING_REGISTER_PROBE, pr, 256) == 0
+		&& pr->last_op >= IORING_OP_READ
+		&& (pr->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+
+	close(fd);
+
+	return ok;
+}
+
+bool IoUring::enabled() {
+	static bool supported = probe();
+	return wanted && supported;
+}
+
+IoUring *IoUring::create(unsigned int entries) {
+	if ( !enabled() )
+		return NULL;
+
+	// Rings can run out (eg the locked memory limit on older kernels), then we just do without
+	try {
+		return new IoUring(entries);
+	} catch (std::exception &) {
+		return NULL;
+	}
+}
+
+IoUring::IoUring(unsigned int entries)
+	: entries(entries), fd(-1), sqmap(MAP_FAILED), sqmaplen(0), cqmap(MAP_FAILED), cqmaplen(0), sqemap(MAP_FAILED), sqemaplen(0),
+	  sqhead(NULL), sqtail(NULL), sqmask(0), sqarray(NULL), cqhead(NULL), cqtail(NULL), cqmask(0), cqes(NULL), queued(0), inflight(0) {
+
+	assert ( entries > 0 );
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	fd = io_uring_setup(entries, &p);
+
+	if ( fd < 0 )
+		throw vargs_exception( "%s:%d: io_uring_setup failed errno(%d)", __FILE__, __LINE__, errno );
+
+	// The kernel rounds entries up to a power of two, but we keep to what was asked for
+	sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels put both rings in one mapping
+	if ( p.features & IORING_FEAT_SINGLE_MMAP )
+		sqmaplen = cqmaplen = std::max(sqmaplen, cqmaplen);
+
+	sqmap = mmap(NULL, sqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	if ( sqmap == MAP_FAILED ) {
+		int err = errno;
+		release();
+		throw vargs_exception( "%s:%d: mmap failed errno(%d)", __FILE__, __LINE__, err );
+	}
+
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		cqmap = sqmap;
+	} else {
+		cqmap = mmap(NULL, cqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+
+	sqemaplen = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqemap = mmap(NULL, sqemaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if ( cqmap == MAP_FAILED || sqemap == MAP_FAILED ) {
+		int err = errno;
+		release();
+		throw vargs_exception( "%s:%d: mmap failed errno(%d)", __FILE__, __LINE__, err );
+	}
+
+	unsigned char *sq = (unsigned char *)sqmap;
+	sqhead  = (unsigned int *)(sq + p.sq_off.head);
+	sqtail  = (unsigned int *)(sq + p.sq_off.tail);
+	sqmask  = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	sqarray = (unsigned int *)(sq + p.sq_off.array);
+
+	unsigned char *cq = (unsigned char *)cqmap;
+	cqhead  = (unsigned int *)(cq + p.cq_off.head);
+	cqtail  = (unsigned int *)(cq + p.cq_off.tail);
+	cqmask  = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	cqes    = cq + p.cq_off.cqes;
+}
+
+IoUring::~IoUring() {
+	release();
+}
+
+void IoUring::release() {
+	if ( sqemap != MAP_FAILED )
+		munmap(sqemap, sqemaplen);
+
+	if ( cqmap != MAP_FAILED && cqmap != sqmap )
+		munmap(cqmap, cqmaplen);
+
+	if ( sqmap != MAP_FAILED )
+		munmap(sqmap, sqmaplen);
+
+	if ( fd >= 0 )
+		close(fd);
+
+	sqemap = cqmap = sqmap = MAP_FAILED;
+	fd = -1;
+}
+
+bool IoUring::read(int infd, unsigned char *buf, size_t len, off_t offset, unsigned long long tag) {
+
+	if ( pending() >= entries )
+		return false;
+
+	// There are never more than entries reads queued or in flight, so there is always room
+	unsigned int tail = *sqtail;
+	unsigned int index = tail & sqmask;
+
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqemap + index;
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = infd;
+	sqe->addr = (unsigned long long)(size_t)buf;
+	sqe->len = (unsigned int)len;
+	sqe->off = (unsigned long long)offset;
+	sqe->user_data = tag;
+
+	sqarray[index] = index;
+
+	__atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+
+	queued++;
+	return true;
+}
+
+void IoUring::submit() {
+
+	while ( queued > 0 ) {
+		int ret = io_uring_enter(fd, queued, 0, 0);
+
+		if ( ret < 0 ) {
+			if ( errno == EINTR || errno == EAGAIN )
+				continue;
+
+			throw vargs_exception( "%s:%d: io_uring_enter failed errno(%d)", __FILE__, __LINE__, errno );
+		}
+
+		queued -= (unsigned int)ret;
+		inflight += (unsigned int)ret;
+	}
+}
+
+bool IoUring::complete(unsigned long long &tag, int &result, bool wait) {
+
+	for (;;) {
+		// We are the only one removing entries, so only the kernel's tail needs to be read carefully
+		unsigned int head = *cqhead;
+
+		if ( head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE) ) {
+			struct io_uring_cqe *cqe = (struct io_uring_cqe *)cqes + (head & cqmask);
+
+			tag = cqe->user_data;
+			result = cqe->res;
+
+			__atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+
+			inflight--;
+			return true;
+		}
+
+		if ( !wait || pending() == 0 )
+			return false;
+
+		int ret = io_uring_enter(fd, queued, 1, IORING_ENTER_GETEVENTS);
+
+		if ( ret < 0 ) {
+			if ( errno == EINTR || errno == EAGAIN )
+				continue;
+
+			throw vargs_exception( "%s:%d: io_uring_enter failed errno(%d)", __FILE__, __LINE__, errno );
+		}
+
+		queued -= (unsigned int)ret;
+		inflight += (unsigned int)ret;
+	}
+}
+
+#else
+
+// Without io_uring, create never makes a ring, so the rest is never used
+
+bool IoUring::enabled() {
+	return false;
+}
+
+IoUring *IoUring::create(unsigned int) {
+	return NULL;
+}
+
+IoUring::~IoUring() {}
+
+bool IoUring::read(int, unsigned char *, size_t, off_t, unsigned long long) {
+	return false;
+}
+
+void IoUring::submit() {}
+
+bool IoUring::complete(unsigned long long &, int &, bool) {
+	return false;
+}
+
+void IoUring::release() {}
+
+#endif
+
@@ -0,0 +1,99 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _IOURING_H_
+#define _IOURING_H_
+
+#include "common.h"
+
+#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define HAVE_IO_URING
+	#endif
+#endif
+
+/**
+	A Linux io_uring, used through the raw system calls, that only does reads.
+	Many reads can be in flight at once, which helps on storage (such as network
+	block devices) limited by how many requests it has, rather than bandwidth.
+	It is only used if asked for (see enable), and the kernel supports it,
+	otherwise create returns NULL and the callers read with fread_at as usual.
+	A ring belongs to one thread
+*/
+class IoUring {
+
+	public:
+
+		// Asks for io_uring to be used where it can be, it is off by default
+		static void enable(bool on);
+
+		// True if io_uring was asked for, and the kernel can do it
+		static bool enabled();
+
+		// Returns a new ring with room for entries reads at once, or NULL if io_uring is not enabled
+		static IoUring *create(unsigned int entries);
+
+		~IoUring();
+
+		// Queues a read of len bytes at offset in fd into buf, tag is returned with its result
+		// Returns false (and queues nothing) if there are already entries reads queued or in flight
+		bool read(int fd, unsigned char *buf, size_t len, off_t offset, unsigned long long tag);
+
+		// Hands the queued reads to the kernel
+		void submit();
+
+		// Gets a finished read, its tag and result (the bytes read, or -errno). If none has finished,
+		// waits for one if wait is set (submitting any queued), otherwise returns false
+		bool complete(unsigned long long &tag, int &result, bool wait);
+
+		// How many reads are queued or in flight
+		unsigned int pending() const { return queued + inflight; };
+
+	private:
+
+		IoUring(unsigned int entries);
+
+		// Unmaps and closes everything
+		void release();
+
+		unsigned int entries;
+
+		int fd;
+
+		// The mappings shared with the kernel
+		void *sqmap;
+		size_t sqmaplen;
+		void *cqmap;
+		size_t cqmaplen;
+		void *sqemap;
+		size_t sqemaplen;
+
+		// Pointers into the mappings
+		unsigned int *sqhead;
+		unsigned int *sqtail;
+		unsigned int sqmask;
+		unsigned int *sqarray;
+
+		unsigned int *cqhead;
+		unsigned int *cqtail;
+		unsigned int cqmask;
+		unsigned char *cqes;
+
+		// Queued but not submitted, and submitted but not complete
+		unsigned int queued;
+		unsigned int inflight;
+
+		static bool wanted;
+
+		// Not copyable
+		IoUring(const IoUring &);
+		IoUring & operator = (const IoUring &);
+};
+
+#endif
@@ -0,0 +1,133 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "KeyFrameIndex.h"
+#include "Tag.h"
+#include "AMF.h"
+#include "InputFile.h"
+
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+using std::string;
+using std::vector;
+
+// Stores n, little endian, into len bytes at out
+static void put_le(unsigned char *out, unsigned long long n, size_t len) {
+	for ( size_t i = 0; i < len; i++ ) {
+		out[i] = (unsigned char)( n & 0xFF );
+		n >>= 8;
+	}
+}
+
+// Returns the doubles in o's key, or NULL if it isn't a array of doubles
+static const vector<double> *doubles(const AMFObject *o, const char *key) {
+	const AMFDoubleArray *a = dynamic_cast<const AMFDoubleArray *>( o->get(key) );
+
+	return a != NULL ? &a->v : NULL;
+}
+
+KeyFrameIndex::KeyFrameIndex(const MetaTag *meta) {
+
+	if ( meta == NULL )
+		return;
+
+	const AMFObject *o = dynamic_cast<const AMFObject *>( meta->get("keyframes") );
+
+	if ( o == NULL )
+		return;
+
+	const vector<double> *t = doubles(o, "times");
+	const vector<double> *b = doubles(o, "filepositions");
+
+	if ( t == NULL || b == NULL || t->size() != b->size() )
+		return;
+
+	times.reserve( t->size() );
+	offsets.reserve( b->size() );
+
+	// The meta data has the times in seconds, they were ms to start with so round back to them
+	for ( size_t i = 0; i < t->size(); i++ ) {
+		times.push_back( (unsigned long long) floor( (*t)[i] * 1000.0 + 0.5 ) );
+		offsets.push_back( (unsigned long long) (*b)[i] );
+	}
+}
+
+string KeyFrameIndex::filename(const char *flv) {
+	return string( flv ) + ".idx";
+}
+
+void KeyFrameIndex::save(const char *filename, off_t filesize) const {
+
+	unsigned int flags = Sorted;
+
+	for ( size_t i = 1; i < times.size(); i++ ) {
+		if ( times[i] < times[i - 1] ) {
+			flags &= ~Sorted;
+			break;
+		}
+	}
+
+	unsigned char header[HEADER_LEN];
+	memset(header, 0, sizeof(header));
+
+	memcpy(header, "FLVKEYS", 8);
+	put_le(header + 8, VERSION, 4);
+	put_le(header + 12, flags, 4);
+	put_le(header + 16, times.size(), 8);
+	put_le(header + 24, (unsigned long long) filesize, 8);
+
+	// Written beside the old one and then moved over it, so a server never maps half of a index
+	string tmp = string( filename ) + ".tmp";
+
+	FILE *fp = InputFile::open(tmp.c_str(), "wb");
+
+	if ( fp == NULL )
+		throw vargs_exception("Error %d opening output file '%s'\n", errno, tmp.c_str());
+
+	try {
+		fwrite_s(fp, header, sizeof(header));
+
+		vector<unsigned char> buf ( 4096 * ENTRY_LEN );
+
+		for ( size_t i = 0; i < times.size(); i += 4096 ) {
+			size_t n = std::min( times.size() - i, (size_t)4096 );
+
+			for ( size_t j = 0; j < n; j++ ) {
+				put_le(&buf[j * ENTRY_LEN], times[i + j], 8);
+				put_le(&buf[j * ENTRY_LEN + 8], offsets[i + j], 8);
+			}
+
+			fwrite_s(fp, &buf[0], n * ENTRY_LEN);
+		}
+
+	} catch ( ... ) {
+		fclose(fp);
+		remove(tmp.c_str());
+		throw;
+	}
+
+	if ( fclose(fp) ) {
+		remove(tmp.c_str());
+		throw vargs_exception( "%s:%d: fclose failed errno(%d)", __FILE__, __LINE__, errno);
+	}
+
+#ifdef WIN32
+	// Windows won't rename over a file
+	remove(filename);
+#endif
+
+	if ( rename(tmp.c_str(), filename) ) {
+		int err = errno;
+		remove(tmp.c_str());
+		throw vargs_exception("Error %d replacing '%s'\n", err, filename);
+	}
+}
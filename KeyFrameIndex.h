@@ -0,0 +1,65 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _KEYFRAMEINDEX_H_
+#define _KEYFRAMEINDEX_H_
+
+#include "common.h"
+
+#include <string>
+#include <vector>
+
+class MetaTag;
+
+/**
+	A binary index of a FLV file's keyframes, written next to it (as <file>.idx) for seek servers,
+	so they can find where to start streaming from without reading the FLV, or parsing AMF.
+	It is meant to be mapped and binary searched as it is, so every field is little endian,
+	and aligned to its size:
+
+		 0  char[8]  "FLVKEYS\0"
+		 8  u32      VERSION
+		12  u32      Flags
+		16  u64      how many keyframes
+		24  u64      the size of the FLV file, so a index that doesn't belong to it can be spotted
+		32  the keyframes in stream order, each a u64 timestamp in ms, then the u64 byte offset of its tag
+
+	The keyframes are the same as the index in the FLV's meta data (see FLVStream::addIndex)
+*/
+class KeyFrameIndex {
+
+	public:
+
+		enum Flags {
+			Sorted = 0x01, // The timestamps never go backwards, so can be binary searched
+		};
+
+		const static unsigned int VERSION = 1;
+
+		const static size_t HEADER_LEN = 32;
+		const static size_t ENTRY_LEN = 16;
+
+		// The index in meta's "keyframes" object, which is empty if there isn't one (or meta is NULL)
+		KeyFrameIndex(const MetaTag *meta);
+
+		// Writes the index of a FLV file of filesize bytes to filename, replacing any already there
+		void save(const char *filename, off_t filesize) const;
+
+		// The name of the index of the FLV file flv
+		static std::string filename(const char *flv);
+
+		size_t size() const { return times.size(); };
+
+	private:
+
+		std::vector<unsigned long long> times;
+		std::vector<unsigned long long> offsets;
+};
+
+#endif
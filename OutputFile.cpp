@@ -0,0 +1,187 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "OutputFile.h"
+#include "InputFile.h"
+
+#include <algorithm>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef WIN32
+	#include <io.h>
+	#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+	#include <unistd.h>
+	#include <sys/sendfile.h>
+#endif
+
+OutputFile::OutputFile(const char *filename) : fp(NULL), copiedBytes(0), bufin(NULL), bufpos(0), buflen(0), usecopyrange(true), usesendfile(true) {
+
+	assert ( filename != NULL );
+	assert ( strlen( filename ) > 0 );
+
+	// "-" writes to stdout
+	if ( strcmp(filename, "-") == 0 ) {
+#ifdef WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		fp = stdout;
+		return;
+	}
+
+	fp = InputFile::open(filename, "wb");
+
+	if (fp == NULL) {
+		throw vargs_exception("Error %d opening output file '%s'\n", errno, filename);
+	}
+}
+
+OutputFile::~OutputFile() {
+	if ( fp == stdout )
+		fflush(fp);
+	else
+		fclose(fp);
+}
+
+void OutputFile::copy(const InputFile &in, off_t offset, off_t len) {
+
+	assert ( offset >= 0 );
+	assert ( len >= 0 );
+
+	if ( len == 0 )
+		return;
+
+	copiedBytes += len;
+
+	if ( (size_t)len >= MIN_KERNEL_COPY && copy_kernel(in, offset, len) )
+		return;
+
+	copy_buffered(in, offset, len);
+}
+
+void OutputFile::write(const unsigned char *data, size_t len) {
+	fwrite_s(fp, data, len);
+	copiedBytes += len;
+}
+
+// Returns false if the kernel can't do this copy (and nothing was copied)
+bool OutputFile::copy_kernel(const InputFile &in, off_t offset, off_t len) {
+
+#ifdef __linux__
+	if ( !usecopyrange && !usesendfile )
+		return false;
+
+	// Anything still in the FILE* buffer must be written before the kernel appends to the file
+	if (fflush(fp))
+		throw vargs_exception( "%s:%d: fflush failed errno(%d)", __FILE__, __LINE__, errno);
+
+	FILE *infp = in.file();
+
+	// The input is spooled in memory
+	if ( infp == NULL )
+		return false;
+
+	int infd = fileno(infp);
+	int outfd = fileno(fp);
+
+	off_t end = offset + len;
+
+	while ( usecopyrange && offset < end ) {
+		loff_t off = offset;
+		ssize_t ret = copy_file_range(infd, &off, outfd, NULL, (size_t)(end - offset), 0);
+
+		if ( ret > 0 ) {
+			offset += ret;
+			continue;
+		}
+
+		if ( ret == 0 )
+			throw std::runtime_error("could not read requested bytes");
+
+		if ( errno == EINTR )
+			continue;
+
+		// The kernel or filesystem doesn't support this, so don't try again
+		if ( errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP && errno != EBADF )
+			throw vargs_exception( "%s:%d: copy_file_range failed errno(%d)", __FILE__, __LINE__, errno);
+
+		usecopyrange = false;
+	}
+
+	while ( usesendfile && offset < end ) {
+		off_t off = offset;
+		ssize_t ret = sendfile(outfd, infd, &off, (size_t)(end - offset));
+
+		if ( ret > 0 ) {
+			offset += ret;
+			continue;
+		}
+
+		if ( ret == 0 )
+			throw std::runtime_error("could not read requested bytes");
+
+		if ( errno == EINTR )
+			continue;
+
+		if ( errno != ENOSYS && errno != EINVAL )
+			throw vargs_exception( "%s:%d: sendfile failed errno(%d)", __FILE__, __LINE__, errno);
+
+		usesendfile = false;
+	}
+
+	// If we gave up half way, the buffer can do the rest
+	if ( offset < end ) {
+		copy_buffered(in, offset, end - offset);
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void OutputFile::copy_buffered(const InputFile &in, off_t offset, off_t len) {
+
+	// If the input is mapped, just write from there
+	const unsigned char *d = in.data(offset, (size_t)len);
+
+	if ( d != NULL ) {
+		fwrite_s(fp, d, (size_t)len);
+		return;
+	}
+
+	if ( buf.empty() )
+		buf.resize( BUFFER_LEN );
+
+	while ( len > 0 ) {
+
+		// Short copies usually follow on from the last (ie tags whose header changed), so read ahead
+		if ( &in != bufin || offset < bufpos || offset >= bufpos + (off_t)buflen ) {
+			bufin = &in;
+			bufpos = offset;
+			buflen = (size_t)std::max( (off_t)0, std::min( (off_t)buf.size(), in.size() - offset ) );
+
+			if ( buflen == 0 )
+				throw std::runtime_error("could not read requested bytes");
+
+			in.read(bufpos, &buf[0], buflen);
+		}
+
+		size_t chunk = (size_t)std::min( len, bufpos + (off_t)buflen - offset );
+
+		fwrite_s(fp, &buf[ offset - bufpos ], chunk);
+
+		offset += chunk;
+		len -= chunk;
+	}
+}
@@ -0,0 +1,75 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _OUTPUTFILE_H_
+#define _OUTPUTFILE_H_
+
+#include "common.h"
+
+#include <vector>
+
+class InputFile;
+
+/**
+	A FLV file opened for writing. Small things (headers, meta data) are written
+	through the FILE*, while large runs of tag data are copied from the InputFile
+	inside the kernel with copy_file_range, or sendfile if that is not possible,
+	and only as a last resort through a (reused) buffer. Data read ahead by another
+	thread (see ReadAhead) is written through the FILE* too.
+	The filename "-" writes to stdout, which is only ever written from start to end
+*/
+class OutputFile {
+
+	public:
+
+		// Copies shorter than this go through the buffer, since they cost less than the extra syscalls
+		const static size_t MIN_KERNEL_COPY = 64 * 1024;
+
+		const static size_t BUFFER_LEN = 1024 * 1024;
+
+		OutputFile(const char *filename);
+		~OutputFile();
+
+		// Copies len bytes, starting at offset in the input, to the end of this file
+		void copy(const InputFile &in, off_t offset, off_t len);
+
+		// Writes len bytes of tag data (that have already been read) to the end of this file
+		void write(const unsigned char *data, size_t len);
+
+		// How many bytes of tag data have been copied or written so far
+		off_t copied() const { return copiedBytes; };
+
+		FILE *file() const { return fp; };
+
+	private:
+
+		FILE *fp;
+
+		off_t copiedBytes;
+
+		// Used for copies that can't be done in the kernel, it holds buflen bytes of bufin from bufpos
+		// The inputs must not change (or be deleted) while we are open
+		std::vector<unsigned char> buf;
+		const InputFile *bufin;
+		off_t bufpos;
+		size_t buflen;
+
+		// Set to false when the kernel tells us it can't do these copies
+		bool usecopyrange;
+		bool usesendfile;
+
+		bool copy_kernel(const InputFile &in, off_t offset, off_t len);
+		void copy_buffered(const InputFile &in, off_t offset, off_t len);
+
+		// Not copyable
+		OutputFile(const OutputFile &);
+		OutputFile & operator = (const OutputFile &);
+};
+
+#endif
@@ -0,0 +1,339 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "ReadAhead.h"
+#include "InputFile.h"
+#include "OutputFile.h"
+#include "IoUring.h"
+
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <assert.h>
+
+#ifndef WIN32
+	#include <sched.h>
+	#include <unistd.h>
+#endif
+
+// Waits a little for the other side, at first just giving up our time slice, then sleeping
+// so a reader stuck on a slow disk doesn't keep a CPU busy
+static void backoff(unsigned int &tries) {
+#ifndef WIN32
+	if ( tries++ < 64 )
+		sched_yield();
+	else
+		usleep(100);
+#endif
+}
+
+ReadAhead::ReadAhead(Runs &runs, size_t depth, size_t buflen)
+	: runs(runs), buflen(buflen), pool(depth * buflen), filled(depth), full(depth), empty(depth), current(depth), used(0), stop(0), finished(0) {
+
+	assert ( depth > 0 );
+	assert ( buflen > 0 );
+	assert ( available() );
+
+	for ( size_t b = 0; b < depth; b++ )
+		empty.push(b);
+
+	start();
+}
+
+ReadAhead::~ReadAhead() {
+	store_release(stop, 1);
+	join();
+}
+
+bool ReadAhead::available() {
+#ifdef WIN32
+	return false;
+#else
+	return true;
+#endif
+}
+
+/**
+	Does the reads into ReadAhead's buffers, either straight away, or through an IoUring (if enabled)
+	with many reads in flight at once. Either way the buffers go to the writer in order, once all of
+	their reads are done
+*/
+class BufferReads {
+
+	public:
+
+		// How many reads can be in flight
+		const static unsigned int ENTRIES = 64;
+
+		BufferReads(Ring<size_t> &full, size_t buffers)
+			: full(full), ring(IoUring::create(ENTRIES)), outstanding(buffers, 0), lastIn(NULL) {
+
+			if ( ring != NULL ) {
+				requests.resize(ENTRIES);
+
+				for ( size_t r = 0; r < ENTRIES; r++ )
+					freeRequests.push_back(r);
+			}
+		}
+
+		~BufferReads() {
+			// The kernel must be done with the buffers before they go
+			try {
+				while ( ring != NULL && ring->pending() > 0 )
+					reap();
+			} catch (std::exception &) {}
+
+			delete ring;
+		}
+
+		// Reads len bytes of in at start into dest, which is part of buffer b
+		void read(size_t b, const InputFile *in, off_t start, unsigned char *dest, size_t len) {
+
+			if ( ring == NULL || in->isMapped() ) {
+				in->read(start, dest, len);
+				return;
+			}
+
+			use(in);
+
+			// Spooled in memory
+			if ( in->file() == NULL ) {
+				in->read(start, dest, len);
+				return;
+			}
+
+			while ( freeRequests.empty() )
+				reap();
+
+			size_t r = freeRequests.back();
+			freeRequests.pop_back();
+
+			Request &q = requests[r];
+			q.in = in;
+			q.start = start;
+			q.dest = dest;
+			q.len = len;
+			q.buffer = b;
+
+			outstanding[b]++;
+
+			queue(r);
+		}
+
+		// All of buffer b's reads have been asked for, it goes to the writer once they are done
+		void seal(size_t b) {
+			sealed.push_back(b);
+
+			if ( ring != NULL )
+				ring->submit();
+
+			handOver();
+		}
+
+		// Waits for a read to finish, returns false if there are none in flight
+		bool progress() {
+			if ( ring == NULL || ring->pending() == 0 )
+				return false;
+
+			reap();
+			return true;
+		}
+
+		// Waits for all the reads to finish
+		void finish() {
+			while ( progress() ) {}
+
+			handOver();
+		}
+
+	private:
+
+		struct Request {
+			const InputFile *in;
+			off_t start;
+			unsigned char *dest;
+			size_t len;
+			size_t buffer;
+		};
+
+		Ring<size_t> &full;
+
+		IoUring *ring;
+
+		std::vector<Request> requests;
+		std::vector<size_t> freeRequests;
+
+		// How many reads each buffer is waiting for, and the buffers waiting for them in order
+		std::vector<unsigned int> outstanding;
+		std::deque<size_t> sealed;
+
+		// The file of the last reads queued
+		const InputFile *lastIn;
+
+		// Getting another file's FILE* may close (and reuse the handle of) one we have reads queued for,
+		// see InputFile, so those are handed to the kernel first, which then holds on to the file
+		void use(const InputFile *in) {
+			if ( in != lastIn ) {
+				ring->submit();
+				lastIn = in;
+			}
+		}
+
+		// There are as many requests as room in the ring, so this can't fail
+		void queue(size_t r) {
+			const Request &q = requests[r];
+
+			bool queued = ring->read(fileno(q.in->file()), q.dest, q.len, q.start, r);
+
+			assert ( queued );
+			(void)queued;
+		}
+
+		void reap() {
+			unsigned long long tag;
+			int result;
+
+			ring->complete(tag, result, true);
+
+			Request &q = requests[tag];
+
+			bool partial = result > 0 && (size_t)result < q.len;
+
+			if ( partial ) {
+				q.start += result;
+				q.dest += result;
+				q.len -= result;
+			}
+
+			// Interrupted or short, so ask for the rest
+			if ( result == -EINTR || result == -EAGAIN || partial ) {
+				use(q.in);
+				queue((size_t)tag);
+				ring->submit();
+				return;
+			}
+
+			if ( result < 0 )
+				throw vargs_exception( "%s:%d: io_uring read failed errno(%d)", __FILE__, __LINE__, -result );
+
+			if ( result == 0 )
+				throw std::runtime_error("could not read requested bytes");
+
+			outstanding[q.buffer]--;
+			freeRequests.push_back((size_t)tag);
+
+			handOver();
+		}
+
+		// There are only as many buffers as room in the ring, so pushing can't fail
+		void handOver() {
+			while ( !sealed.empty() && outstanding[sealed.front()] == 0 ) {
+				full.push(sealed.front());
+				sealed.pop_front();
+			}
+		}
+};
+
+void ReadAhead::run() {
+
+	const InputFile *in;
+	off_t start;
+	off_t len;
+
+	// The buffer being read into (filled.size() if none)
+	size_t b = filled.size();
+	size_t fill = 0;
+
+	try {
+		BufferReads reads(full, filled.size());
+
+		while ( runs.next(in, start, len) ) {
+
+			while ( len > 0 ) {
+				if ( b == filled.size() ) {
+					unsigned int tries = 0;
+
+					while ( !empty.pop(b) ) {
+						if ( load_acquire(stop) )
+							return;
+
+						if ( !reads.progress() )
+							backoff(tries);
+					}
+
+					fill = 0;
+				}
+
+				size_t chunk = (size_t)std::min( len, (off_t)(buflen - fill) );
+
+				reads.read(b, in, start, &pool[b * buflen + fill], chunk);
+
+				fill += chunk;
+				start += chunk;
+				len -= chunk;
+
+				if ( fill == buflen ) {
+					filled[b] = fill;
+					reads.seal(b);
+					b = filled.size();
+				}
+			}
+		}
+
+		if ( b != filled.size() ) {
+			filled[b] = fill;
+			reads.seal(b);
+		}
+
+		reads.finish();
+
+	} catch (std::exception &e) {
+		error = e.what();
+	}
+
+	store_release(finished, 1);
+}
+
+void ReadAhead::copy(OutputFile &out, off_t len) {
+
+	assert ( len >= 0 );
+
+	while ( len > 0 ) {
+
+		if ( current == filled.size() ) {
+			unsigned int tries = 0;
+
+			while ( !full.pop(current) ) {
+				if ( load_acquire(finished) ) {
+					// The reader may have pushed its last buffer just before finishing
+					if ( full.pop(current) )
+						break;
+
+					throw std::runtime_error( error.empty() ? "could not read requested bytes" : error );
+				}
+
+				backoff(tries);
+			}
+
+			used = 0;
+		}
+
+		size_t chunk = (size_t)std::min( len, (off_t)(filled[current] - used) );
+
+		out.write(&pool[current * buflen + used], chunk);
+
+		used += chunk;
+		len -= chunk;
+
+		if ( used == filled[current] ) {
+			empty.push(current);
+			current = filled.size();
+		}
+	}
+}
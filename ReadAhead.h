@@ -0,0 +1,94 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include "common.h"
+#include "Ring.h"
+#include "Thread.h"
+
+#include <string>
+#include <vector>
+
+class InputFile;
+class OutputFile;
+
+/**
+	Reads ahead of a writer. A thread reads the runs of input the writer is going to copy, in order,
+	into a pool of buffers, and hands the full ones over through a Ring, so the reads of one
+	buffer overlap the writes of the last. The empty buffers come back through another Ring.
+	With io_uring enabled (see IoUring), the reads of many runs are in flight at once.
+	Without pthreads this can't work (nothing would run the reader), see available()
+*/
+class ReadAhead : public Thread {
+
+	public:
+
+		/**
+			Where the runs to read come from, in the order they will be copied
+		*/
+		class Runs {
+			public:
+				virtual ~Runs() {}
+
+				// Sets the next run, or returns false after the last
+				virtual bool next(const InputFile * &in, off_t &start, off_t &len) = 0;
+		};
+
+		const static size_t DEFAULT_DEPTH = 4;
+		const static size_t DEFAULT_BUFFER_LEN = 1024 * 1024;
+
+		// Starts reading runs into depth buffers of buflen bytes, runs must outlive us
+		ReadAhead(Runs &runs, size_t depth = DEFAULT_DEPTH, size_t buflen = DEFAULT_BUFFER_LEN);
+
+		// Stops the reader (if it hasn't finished)
+		~ReadAhead();
+
+		// Writes the next len bytes read to out, which must be the whole of the next run (or runs)
+		void copy(OutputFile &out, off_t len);
+
+		// False if threads don't run at the same time, so nothing can be read ahead
+		static bool available();
+
+	protected:
+
+		void run();
+
+	private:
+
+		Runs &runs;
+
+		size_t buflen;
+
+		// depth buffers of buflen bytes, and how much of each is filled
+		std::vector<unsigned char> pool;
+		std::vector<size_t> filled;
+
+		// Buffers read and waiting to be written, and ones written and waiting to be read into
+		Ring<size_t> full;
+		Ring<size_t> empty;
+
+		// The buffer being written (depth if none), and how much of it is written
+		size_t current;
+		size_t used;
+
+		// Set by the writer to make the reader give up, and by the reader once it is done
+		volatile size_t stop;
+		volatile size_t finished;
+
+		// Why the reader stopped early (empty if it didn't)
+		std::string error;
+
+		// Not copyable
+		ReadAhead(const ReadAhead &);
+		ReadAhead & operator = (const ReadAhead &);
+};
+
+#endif
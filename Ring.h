@@ -0,0 +1,75 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+#include <vector>
+
+// Loads and stores that order the memory accesses around them, so one thread can hand data to another
+// Without pthreads there is only ever one thread (see Thread), so plain volatile access is enough
+#ifdef WIN32
+	inline size_t load_acquire(const volatile size_t &x) { return x; }
+	inline void store_release(volatile size_t &x, size_t v) { x = v; }
+#else
+	inline size_t load_acquire(const volatile size_t &x) { return __atomic_load_n(&x, __ATOMIC_ACQUIRE); }
+	inline void store_release(volatile size_t &x, size_t v) { __atomic_store_n(&x, v, __ATOMIC_RELEASE); }
+#endif
+
+/**
+	A fixed size queue for exactly one thread pushing and one thread popping, without any locks.
+	Each index is only ever written by one side, the producer owns tail and the consumer head
+*/
+template <typename T>
+class Ring {
+
+	public:
+
+		// Holds up to capacity items
+		Ring(size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+		// Called only by the producer, returns false if the ring is full
+		bool push(const T &item) {
+			size_t t = tail;
+			size_t next = (t + 1) % slots.size();
+
+			if ( next == load_acquire(head) )
+				return false;
+
+			slots[t] = item;
+			store_release(tail, next);
+			return true;
+		}
+
+		// Called only by the consumer, returns false if the ring is empty
+		bool pop(T &item) {
+			size_t h = head;
+
+			if ( h == load_acquire(tail) )
+				return false;
+
+			item = slots[h];
+			store_release(head, (h + 1) % slots.size());
+			return true;
+		}
+
+	private:
+
+		std::vector<T> slots;
+
+		volatile size_t head;
+		volatile size_t tail;
+
+		// Not copyable
+		Ring(const Ring &);
+		Ring & operator = (const Ring &);
+};
+
+#endif
@@ -0,0 +1,440 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "ScanCache.h"
+#include "FLV.h"
+
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#ifndef WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+using std::string;
+using std::vector;
+
+string ScanCache::directory;
+
+// Bumped whenever the layout, or what parsing puts in the table, changes
+static const unsigned int VERSION = 1;
+
+// Written in the machine's own byte order, so a entry from a machine with the other order doesn't match
+static const unsigned int ORDER = 0x01020304;
+
+static const char MAGIC[8] = "FLVSCAN";
+
+// No meta data tag
+static const unsigned long long NO_ROW = ~0ULL;
+
+// A file modified this recently may still be being written (or be changed again within the same
+// tick of its modification time, which we wouldn't notice), so isn't saved
+static const time_t SETTLE_SECONDS = 2;
+
+/**
+	The start of a entry, followed by the columns of the TagTable (each starting on a 8 byte boundary):
+	offsets, lengths, timestamps, types, infos, flags, then FLVStream's keyframeRows, timeRuns and keyframeRuns
+*/
+struct ScanCache::Header {
+	char magic[8];
+	unsigned int version;
+	unsigned int order;
+
+	// The file the entry is for, as it was when parsed
+	unsigned long long device;
+	unsigned long long inode;
+	unsigned long long size;
+	unsigned long long mtime;
+	unsigned long long mtimeNsec;
+
+	// How long each column is
+	unsigned long long rows;
+	unsigned long long keyframeRows;
+	unsigned long long timeRuns;
+	unsigned long long keyframeRuns;
+
+	// The row of the meta data tag kept as a object (or NO_ROW)
+	unsigned long long metaRow;
+
+	unsigned int audiotags;
+	unsigned int videotags;
+	unsigned int metatags;
+	unsigned int undefinedtags;
+	unsigned int keyframes;
+
+	unsigned int videocodec;
+	unsigned int audiocodec;
+	unsigned int width;
+	unsigned int height;
+
+	unsigned int unused;
+};
+
+static unsigned long long align8(unsigned long long n) {
+	return (n + 7) & ~7ULL;
+}
+
+/**
+	Where each column starts in a entry, and how long it is
+*/
+struct ScanCache::Layout {
+	unsigned long long offsets, lengths, timestamps, types, infos, flags, keyframeRows, timeRuns, keyframeRuns, total;
+
+	Layout(const Header &h) {
+		offsets = align8( sizeof(Header) );
+		lengths = offsets + h.rows * 8;
+		timestamps = lengths + h.rows * 4;
+		types = timestamps + h.rows * 4;
+		infos = types + h.rows;
+		flags = infos + h.rows;
+		keyframeRows = align8( flags + h.rows );
+		timeRuns = keyframeRows + h.keyframeRows * 8;
+		keyframeRuns = timeRuns + h.timeRuns * 8;
+		total = keyframeRuns + h.keyframeRuns * 8;
+	}
+};
+
+void ScanCache::setDirectory(const string &dir) {
+	directory = dir;
+}
+
+bool ScanCache::enabled() {
+	return available() && !directory.empty();
+}
+
+bool ScanCache::available() {
+#ifdef WIN32
+	return false;
+#else
+	return true;
+#endif
+}
+
+#ifndef WIN32
+
+/**
+	What a entry is keyed on
+*/
+struct FileKey {
+	unsigned long long device;
+	unsigned long long inode;
+	unsigned long long size;
+	unsigned long long mtime;
+	unsigned long long mtimeNsec;
+};
+
+// Gets the key of in, returns false if it doesn't have one (stdin, or a spool)
+static bool fileKey(const InputFile &in, FileKey &key) {
+
+	if ( in.isStdin() )
+		return false;
+
+	FILE *fp = in.file();
+	struct stat st;
+
+	if ( fp == NULL || fstat(fileno(fp), &st) )
+		return false;
+
+	key.device = (unsigned long long)st.st_dev;
+	key.inode = (unsigned long long)st.st_ino;
+	key.size = (unsigned long long)st.st_size;
+	key.mtime = (unsigned long long)st.st_mtime;
+
+#if defined(__linux__)
+	key.mtimeNsec = (unsigned long long)st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	key.mtimeNsec = (unsigned long long)st.st_mtimespec.tv_nsec;
+#else
+	key.mtimeNsec = 0;
+#endif
+
+	// Unless the file has changed since we opened it
+	return (off_t)key.size == in.size();
+}
+
+static string entryName(const string &directory, const FileKey &key) {
+	char name[64];
+	sprintf(name, "/%llx-%llx.scan", key.device, key.inode);
+
+	return directory + name;
+}
+
+#endif
+
+ScanCache::ScanCache(const InputFile &in)
+	: head(NULL), map(NULL), maplen(0), offsets(NULL), lengths(NULL), timestamps(NULL), types(NULL), infos(NULL), flags(NULL),
+		keyframeRows(NULL), timeRuns(NULL), keyframeRuns(NULL) {
+
+#ifndef WIN32
+	FileKey key;
+
+	if ( !enabled() || !fileKey(in, key) )
+		return;
+
+	int fd = open(entryName(directory, key).c_str(), O_RDONLY);
+
+	if ( fd < 0 )
+		return;
+
+	struct stat st;
+
+	if ( fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header) && (off_t)(size_t)st.st_size == st.st_size ) {
+		void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if ( m != MAP_FAILED ) {
+			map = m;
+			maplen = (size_t)st.st_size;
+		}
+	}
+
+	close(fd);
+
+	if ( map == NULL )
+		return;
+
+	const Header *h = (const Header *)map;
+
+	if ( h->device == key.device && h->inode == key.inode && h->size == key.size &&
+			h->mtime == key.mtime && h->mtimeNsec == key.mtimeNsec && check( in.size() ) )
+		head = h;
+#endif
+}
+
+ScanCache::~ScanCache() {
+#ifndef WIN32
+	if ( map != NULL )
+		munmap(map, maplen);
+#endif
+}
+
+bool ScanCache::check(off_t size) {
+
+	const Header &h = *(const Header *)map;
+	const unsigned char *base = (const unsigned char *)map;
+
+	if ( memcmp(h.magic, MAGIC, sizeof(MAGIC)) || h.version != VERSION || h.order != ORDER )
+		return false;
+
+	if ( h.rows > maplen || h.keyframeRows > h.rows || h.timeRuns > h.rows || h.keyframeRuns > h.keyframeRows )
+		return false;
+
+	if ( h.metaRow != NO_ROW && h.metaRow >= h.rows )
+		return false;
+
+	Layout l ( h );
+
+	if ( l.total != maplen )
+		return false;
+
+	offsets = (const unsigned long long *)(base + l.offsets);
+	lengths = (const unsigned int *)(base + l.lengths);
+	timestamps = (const unsigned int *)(base + l.timestamps);
+	types = base + l.types;
+	infos = base + l.infos;
+	flags = base + l.flags;
+	keyframeRows = (const unsigned long long *)(base + l.keyframeRows);
+	timeRuns = (const unsigned long long *)(base + l.timeRuns);
+	keyframeRuns = (const unsigned long long *)(base + l.keyframeRuns);
+
+	// The rest is used as indexes, so a damaged entry mustn't point outside the table, or the file
+	size_t rows = (size_t)h.rows;
+
+	for ( size_t i = 0; i < rows; i++ ) {
+		if ( offsets[i] + lengths[i] + 15 > (unsigned long long)size )
+			return false;
+	}
+
+	for ( size_t i = 0; i < h.keyframeRows; i++ ) {
+		if ( keyframeRows[i] >= h.rows )
+			return false;
+	}
+
+	for ( size_t i = 0; i < h.timeRuns; i++ ) {
+		if ( timeRuns[i] >= h.rows )
+			return false;
+	}
+
+	for ( size_t i = 0; i < h.keyframeRuns; i++ ) {
+		if ( keyframeRuns[i] >= h.keyframeRows )
+			return false;
+	}
+
+	return true;
+}
+
+void ScanCache::restore(FLVStream &flv) const {
+
+	assert ( valid() );
+
+	size_t rows = (size_t)head->rows;
+	TagTable &t = flv.tags;
+
+	t.clear();
+	t.offsets.assign( offsets, offsets + rows );
+	t.lengths.assign( lengths, lengths + rows );
+	t.timestamps.assign( timestamps, timestamps + rows );
+	t.types.assign( types, types + rows );
+	t.infos.assign( infos, infos + rows );
+	t.rowflags.assign( flags, flags + rows );
+
+	// Every row is from our file (the meta data tag too, as after a TagScanner scan)
+	if ( rows > 0 ) {
+		TagTable::Run r = { 0, flv.input.get() };
+		t.runs.push_back( r );
+	}
+
+	flv.audiotags = head->audiotags;
+	flv.videotags = head->videotags;
+	flv.metatags = head->metatags;
+	flv.undefinedtags = head->undefinedtags;
+	flv.keyframes = head->keyframes;
+
+	flv.keyframeRows.assign( keyframeRows, keyframeRows + head->keyframeRows );
+	flv.timeRuns.assign( timeRuns, timeRuns + head->timeRuns );
+	flv.keyframeRuns.assign( keyframeRuns, keyframeRuns + head->keyframeRuns );
+
+	flv.videocodec = (VideoTag::Codec)head->videocodec;
+	flv.audiocodec = (AudioTag::Codec)head->audiocodec;
+	flv.width = head->width;
+	flv.height = head->height;
+
+	delete flv.meta;
+	flv.meta = NULL;
+
+	if ( head->metaRow != NO_ROW )
+		flv.meta = static_cast<MetaTag *> ( t.read( (size_t)head->metaRow ) );
+}
+
+#ifndef WIN32
+
+// Writes column, converted to Stored, returns false if it couldn't
+template <class Stored, class T>
+static bool writeColumn(FILE *fp, const vector<T> &column) {
+	Stored chunk[4096];
+
+	for ( size_t i = 0; i < column.size(); i += 4096 ) {
+		size_t n = std::min( column.size() - i, (size_t)4096 );
+
+		std::copy( column.begin() + i, column.begin() + i + n, chunk );
+
+		if ( fwrite(chunk, sizeof(Stored), n, fp) != n )
+			return false;
+	}
+
+	return true;
+}
+
+// Pads the file out to offset with zeros
+static bool writePadding(FILE *fp, unsigned long long offset) {
+	static const unsigned char zeros[8] = { 0 };
+	off_t pos = ftello(fp);
+
+	return pos >= 0 && (unsigned long long)pos <= offset && fwrite(zeros, 1, (size_t)(offset - pos), fp) == offset - pos;
+}
+
+#endif
+
+void ScanCache::store(const FLVStream &flv) {
+
+#ifndef WIN32
+	FileKey key;
+
+	if ( !enabled() || flv.input.get() == NULL || !fileKey(*flv.input, key) )
+		return;
+
+	if ( (time_t)key.mtime + SETTLE_SECONDS > time(NULL) )
+		return;
+
+	const TagTable &t = flv.tags;
+
+	Header h;
+	memset(&h, 0, sizeof(h));
+
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	h.order = ORDER;
+
+	h.device = key.device;
+	h.inode = key.inode;
+	h.size = key.size;
+	h.mtime = key.mtime;
+	h.mtimeNsec = key.mtimeNsec;
+
+	h.rows = t.size();
+	h.keyframeRows = flv.keyframeRows.size();
+	h.timeRuns = flv.timeRuns.size();
+	h.keyframeRuns = flv.keyframeRuns.size();
+
+	h.metaRow = NO_ROW;
+
+	for ( size_t i = 0; i < t.size() && flv.meta != NULL; i++ ) {
+		if ( t.flags(i) & TagTable::Object ) {
+			h.metaRow = i;
+			break;
+		}
+	}
+
+	h.audiotags = flv.audiotags;
+	h.videotags = flv.videotags;
+	h.metatags = flv.metatags;
+	h.undefinedtags = flv.undefinedtags;
+	h.keyframes = flv.keyframes;
+
+	h.videocodec = flv.videocodec;
+	h.audiocodec = flv.audiocodec;
+	h.width = flv.width;
+	h.height = flv.height;
+
+	Layout l ( h );
+
+	// Written to a temporary file, and renamed over the old entry, so readers never see half of one
+	string name = entryName(directory, key);
+	string pattern = name + ".XXXXXX";
+	vector<char> tmp ( pattern.begin(), pattern.end() );
+	tmp.push_back( '\0' );
+
+	int fd = mkstemp( &tmp[0] );
+
+	if ( fd < 0 )
+		return;
+
+	fchmod(fd, 0644);
+
+	FILE *fp = fdopen(fd, "wb");
+
+	if ( fp == NULL ) {
+		close(fd);
+		unlink(&tmp[0]);
+		return;
+	}
+
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+		&& writePadding(fp, l.offsets) && writeColumn<unsigned long long>(fp, t.offsets)
+		&& writeColumn<unsigned int>(fp, t.lengths)
+		&& writeColumn<unsigned int>(fp, t.timestamps)
+		&& writeColumn<unsigned char>(fp, t.types)
+		&& writeColumn<unsigned char>(fp, t.infos)
+		&& writeColumn<unsigned char>(fp, t.rowflags)
+		&& writePadding(fp, l.keyframeRows) && writeColumn<unsigned long long>(fp, flv.keyframeRows)
+		&& writeColumn<unsigned long long>(fp, flv.timeRuns)
+		&& writeColumn<unsigned long long>(fp, flv.keyframeRuns);
+
+	if ( fclose(fp) )
+		ok = false;
+
+	if ( !ok || rename(&tmp[0], name.c_str()) )
+		unlink(&tmp[0]);
+#endif
+}
@@ -0,0 +1,89 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _SCANCACHE_H_
+#define _SCANCACHE_H_
+
+#include "common.h"
+
+#include <string>
+
+class InputFile;
+class FLVStream;
+
+/**
+	Keeps what parsing the whole of a file found (its TagTable, keyframes and tag counts) in a
+	directory, so the next time the same unchanged file is loaded it isn't parsed at all.
+	Each entry is a binary file named after the device and inode of the FLV, which holds its
+	size and modification time, and is mapped into memory rather than parsed when read.
+	An entry that doesn't match its file is ignored, and replaced after the next full parse.
+	The cache is off until a directory is set
+*/
+class ScanCache {
+
+	public:
+
+		// Keeps the entries in dir (which must exist), or turns the cache off if dir is empty
+		static void setDirectory(const std::string &dir);
+
+		// True if a directory is set, and files can be cached here
+		static bool enabled();
+
+		// False where files have no inode numbers to name the entries after
+		static bool available();
+
+		// Opens the entry for in, if the cache is enabled and there is one that matches in
+		ScanCache(const InputFile &in);
+
+		~ScanCache();
+
+		// True if we have a entry that matches the file
+		bool valid() const { return head != NULL; };
+
+		// Sets up flv as if it had just parsed all of its file, we must be valid
+		void restore(FLVStream &flv) const;
+
+		// Saves a stream that has just parsed all of its file. Errors are ignored, the entry is just
+		// left as it was. Files changed in the last few seconds (which may still be being written) are not saved
+		static void store(const FLVStream &flv);
+
+	private:
+
+		// The layout of a entry, see ScanCache.cpp
+		struct Header;
+		struct Layout;
+
+		const Header *head;
+
+		// The mapping of the entry
+		void *map;
+		size_t maplen;
+
+		// Pointers to each column in the mapping
+		const unsigned long long *offsets;
+		const unsigned int *lengths;
+		const unsigned int *timestamps;
+		const unsigned char *types;
+		const unsigned char *infos;
+		const unsigned char *flags;
+		const unsigned long long *keyframeRows;
+		const unsigned long long *timeRuns;
+		const unsigned long long *keyframeRuns;
+
+		// Checks the mapping is a whole entry, for a file of size bytes, and sets the pointers to its columns
+		bool check(off_t size);
+
+		static std::string directory;
+
+		// Not copyable
+		ScanCache(const ScanCache &);
+		ScanCache & operator = (const ScanCache &);
+};
+
+#endif
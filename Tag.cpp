@@ -13,25 +13,24 @@
 #include <string.h>
 #include <assert.h>
 #include <vector>
+#include <algorithm>
 
 
-TagHeader::TagHeader(FILE *fp) { read(fp); };
+TagHeader::TagHeader(ByteReader &r) { read(r); };
 
 TagHeader::TagHeader() : version(1), flags(0), offset(9) {};
 
-Tag::Tag() : fp(NULL), filepos (~0), length(0), timestamp(0), reserved(0) {}
-AudioTag::AudioTag(FILE *fp) : flags(0) { read(fp); };
-VideoTag::VideoTag(FILE *fp) : frame_type((FrameType)Undefined), codec(Undefined) { read(fp); };
-MetaTag::MetaTag(FILE *fp) : extralen (0) { read(fp); };
-UndefinedTag::UndefinedTag(FILE *fp) { read(fp); };
+Tag::Tag() : in(NULL), filepos (~0), length(0), timestamp(0), reserved(0), modified(false) {}
+AudioTag::AudioTag(ByteReader &r) : flags(0) { read(r); };
+VideoTag::VideoTag(ByteReader &r) : frame_type((FrameType)Undefined), codec(Undefined), picturelen(0) { read(r); };
+MetaTag::MetaTag(ByteReader &r) : extralen (0), extrapos (0), padding (0), minlength (0) { read(r); };
+UndefinedTag::UndefinedTag(ByteReader &r) { read(r); };
 
-void TagHeader::read(FILE *fp) {
-
-	assert(fp != NULL);
+void TagHeader::read(ByteReader &r) {
 
 	// Read Signature 'FLV'
 	char sig[4];
-	fread_s(fp, sig, 3);
+	r.read_s(sig, 3);
 	sig[3] = '\0';
 
 	if (strncmp(sig, "FLV", 3) != 0 ) {
@@ -39,13 +38,13 @@ void TagHeader::read(FILE *fp) {
 	}
 	
 	// Read version
-	version = fread_8(fp);
+	version = r.read_8();
 
 	// Read flags
-	flags = fread_8(fp);
+	flags = r.read_8();
 
 	// Read file header size
-	offset = fread_32(fp);
+	offset = r.read_32();
 	
 	if ( offset < 9 ) {
 		throw std::runtime_error("tag header offset is too small");
@@ -54,11 +53,11 @@ void TagHeader::read(FILE *fp) {
 	// Read to the end of the header
 	if (offset - 9 > 0) {
 		data.reset( new unsigned char[ offset - 9 ] );
-		fread_s(fp, data.get(), offset - 9);
+		r.read_s(data.get(), offset - 9);
 	}
 
 	// Now read a zero prev_length field
-	unsigned int prev_length = fread_32(fp);
+	unsigned int prev_length = r.read_32();
 
 	if (prev_length != 0)
 		throw std::runtime_error("invalid prev_length field");
@@ -87,48 +86,32 @@ size_t TagHeader::size() const {
 	return offset + 4; // plus 4 bytes for the zero prev length
 }
 
-class Tag * fread_Tag(FILE *fp) {
-
-	assert(fp != NULL);
+class Tag * fread_Tag(ByteReader &r) {
 
 	Tag *tag = NULL;
-	Tag::Types type = Tag::Undefined;
+	unsigned char type;
 
-	off_t tagStart = ftello(fp);
+	off_t tagStart = r.tell();
 
-	if (tagStart == -1)
-		throw vargs_exception( "%s:%d: ftello failed errno(%d)", __FILE__, __LINE__, errno );
-
-	// Read the type and then construct a new tag
-	try {
-		type = (Tag::Types) fread_8(fp);
-	} catch (...) {
-		// If a exception is thrown we have got to the end of the file
-		if (feof(fp))
-			return NULL;
-
-		throw;
-	}
-
-	// Seek back one byte
-	if (fseeko(fp, -1, SEEK_CUR ))
-		throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno );
+	// Look at the type and then construct a new tag, if there is no type we have got to the end of the file
+	if (!r.peek_8(type))
+		return NULL;
 
 	switch (type) {
 		case Tag::Audio:
-			tag = new AudioTag(fp);
+			tag = new AudioTag(r);
 			break;
 		case Tag::Video: {
-			tag = new VideoTag(fp);
+			tag = new VideoTag(r);
 			break;
 		}
 		case Tag::Meta: {
-			tag = new MetaTag(fp);
+			tag = new MetaTag(r);
 			break;
 		}
 		case Tag::Undefined:
 		default:
-			tag = new UndefinedTag(fp);
+			tag = new UndefinedTag(r);
 			break;
 	}
 
@@ -136,108 +119,103 @@ class Tag * fread_Tag(FILE *fp) {
 	if (tag->size() != tag->length + 15)
 		throw vargs_exception( "tag's size does not match tag's length (%ld != %ld)", tag->size(), (tag->length + 15) );
 
-	off_t pos = ftello(fp);
-	if (pos == -1)
-		throw vargs_exception( "%s:%d: ftello failed errno(%d)", __FILE__, __LINE__, errno );
+	off_t pos = r.tell();
 
 	if (pos != tagStart + (off_t)tag->size())
-		throw vargs_exception( "did not read full tag (%ld != %ld) errno(%d)", pos, (tagStart + (off_t)tag->size()), errno );
+		throw vargs_exception( "did not read full tag (%ld != %ld)", pos, (tagStart + (off_t)tag->size()) );
 
 	return tag;
 }
 
-void Tag::read(FILE *fp) {
-
-	assert(fp != NULL);
+void Tag::read(ByteReader &r) {
 
 	// Find out where we are in the file
-	this->fp = fp;
-	filepos = ftello(fp);
+	in = r.source();
+	filepos = r.tell();
 
-	Tag::Types type = (Tag::Types)fread_8(fp);
+	Tag::Types type = (Tag::Types)r.read_8();
 
 	// Check this is the correct tag type (if not some code went wrong)
 	assert (type == this->type());
 
 	// Read the length (and 24bit endian swap it)
-	length = fread_24(fp);
+	length = r.read_24();
 
 	// Read the timestamp (and 24bit endian swap it)
-    timestamp = fread_24(fp);
+	timestamp = r.read_24();
 
 	// Read 4 reserved bytes
-	reserved = fread_32(fp);
+	reserved = r.read_32();
 }
 
-void Tag::read_tail(FILE *fp) {
-
-	assert(fp != NULL);
+void Tag::read_tail(ByteReader &r) {
 
 	// Now read the prev length of this tag
-	unsigned int prev_length = fread_32(fp);
+	unsigned int prev_length = r.read_32();
 
 	if (prev_length != length + TAGHEADERLEN)
 		throw std::runtime_error( "prev_length is wrong" );
 }
 
-void AudioTag::read(FILE *fp) {
-
-	assert(fp != NULL);
+void AudioTag::read(ByteReader &r) {
 
-	Tag::read(fp);
+	Tag::read(r);
 
 	if ( length > 0 ) {
-		flags = fread_8(fp);
+		flags = r.read_8();
 
 		//data.reset( new unsigned char[ length - 1 ] );
-		//fread_s(fp, data.get(), length - 1);
-		if (fseeko(fp, length - 1, SEEK_CUR ))
-			throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno);
+		//r.read_s(data.get(), length - 1);
+		r.skip(length - 1);
 	}
 
-	Tag::read_tail(fp);
+	Tag::read_tail(r);
 }
 
-void VideoTag::read(FILE *fp) {
-
-	assert(fp != NULL);
+void VideoTag::read(ByteReader &r) {
 
-	Tag::read(fp);
+	Tag::read(r);
 
 	if ( length > 0 ) {
-		unsigned char tmp = fread_8(fp);
+		unsigned char tmp = r.read_8();
 
 		frame_type = (FrameType)(tmp >> 4);
 		codec = (Codec) ( tmp & 0x0f );
 
 		// Now read the Video data
 		//data.reset( new unsigned char[ length - 1 ] );
-		//fread_s(fp, data.get(), length - 1);
-		if (fseeko(fp, length - 1, SEEK_CUR ))
-			throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno);
-
+		//r.read_s(data.get(), length - 1);
+		picturelen = std::min( (size_t)(length - 1), (size_t)PICTURE_LEN );
+		r.read_s(picture, picturelen);
+		r.skip(length - 1 - picturelen);
 	}
 
-	Tag::read_tail(fp);
+	Tag::read_tail(r);
 }
 
-void MetaTag::read(FILE *fp) {
-
-	assert(fp != NULL);
+void MetaTag::read(ByteReader &r) {
 
 	AMF *amf;
-	Tag::read(fp);
+	Tag::read(r);
+
+	// Read the whole tag in one go, and parse it from memory
+	payload.resize( length );
+
+	if ( length > 0 )
+		r.read_s(&payload[0], length);
 
 	if ( length >= 2 ) {
+		ByteReader p ( &payload[0], length );
+
 		// read the event
-		amf = fread_AMF(fp);
+		amf = fread_AMF(p);
 		if ( amf->type() != AMF_String ) {
 			throw std::runtime_error( "invalid event AMF type" );
 		}
 		event.reset ( (AMFString *)amf );
 
 		// Read the metadata
-		amf = fread_AMF(fp);
+		amf = fread_AMF(p);
 		if ( amf->type() != AMF_Mixed_Array && amf->type() != AMF_Object ) {
 			throw std::runtime_error( "invalid metadata AMF type" );
 		}
@@ -247,11 +225,7 @@ void MetaTag::read(FILE *fp) {
 		size_t read = event->size() + metadata->size() + 2; // +2 bytes for AMF indentifiers
 		if (read < length) {
 			extralen = length - read; 
-
-			//data.reset( new unsigned char[ extralen ] );
-			//fread_s(fp, data.get(), extralen);
-			if (fseeko(fp, extralen, SEEK_CUR ))
-				throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno);
+			extrapos = read;
 
 		} else {
 			extralen = 0;
@@ -259,43 +233,53 @@ void MetaTag::read(FILE *fp) {
 
 	}
 
-	Tag::read_tail(fp);
+	Tag::read_tail(r);
 }
 
-MetaTag::MetaTag(const char *name) : event(new AMFString(name)), metadata(new AMFMixed_Array()), extralen(0) {}
+MetaTag::MetaTag(const char *name) : event(new AMFString(name)), metadata(new AMFMixed_Array()), extralen(0), extrapos(0), padding(0), minlength(0) {}
 
 
-void UndefinedTag::read(FILE *fp) {
+void UndefinedTag::read(ByteReader &r) {
 
-	assert(fp != NULL);
-
-	Tag::read(fp);
+	Tag::read(r);
 
 	if ( length > 0 ) {
 		//data.reset( new unsigned char[ length ] );
-		//fread_s(fp, data.get(), length);
-		if (fseeko(fp, length, SEEK_CUR ))
-			throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno);
+		//r.read_s(data.get(), length);
+		r.skip(length);
 	}
 
-	Tag::read_tail(fp);
+	Tag::read_tail(r);
 }
 
 size_t Tag::read_data(off_t offset, unsigned char *buf, size_t len) const {
 	
-	assert ( fp != NULL );
+	assert ( in != NULL );
 	assert ( filepos != ~0 );
 	
-	// Seek to the data section
-	if (fseeko(fp, filepos + TAGHEADERLEN + offset, SEEK_SET))
-		throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno);
-
-	// Now read the data section
-	fread_s(fp, buf, len);
+	// Read the data section
+	in->read(filepos + TAGHEADERLEN + offset, buf, len);
 
 	return len;
 }
 
+const unsigned char *Tag::data(off_t offset, size_t len, std::vector<unsigned char> &buf) const {
+
+	assert ( in != NULL );
+	assert ( filepos != ~0 );
+
+	// If the file is mapped we can use the data where it is
+	const unsigned char *d = in->data(filepos + TAGHEADERLEN + offset, len);
+
+	if ( d == NULL ) {
+		buf.resize( len );
+		read_data(offset, &buf[0], len);
+		d = &buf[0];
+	}
+
+	return d;
+}
+
 void Tag::write(FILE *fp) const {
 
 	assert(fp != NULL);
@@ -334,10 +318,8 @@ void AudioTag::write(FILE *fp) const {
 		if ( length > 1 ) {
 
 			// Because the data isn't stored, we need to read it (from disk) 
-			std::vector<unsigned char> data ( length - 1 );
-			read_data(1, &data[0], length - 1);
-
-			fwrite_s(fp, &data[0], length - 1);
+			std::vector<unsigned char> buf;
+			fwrite_s(fp, data(1, length - 1, buf), length - 1);
 		}
 	}
 
@@ -358,10 +340,8 @@ void VideoTag::write(FILE *fp) const {
 		if ( length > 1 ) {
 
 			// Because the data isn't stored, we need to read it (from disk) 
-			std::vector<unsigned char> data ( length - 1 );
-			read_data(1, &data[0], length - 1);
-
-			fwrite_s(fp, &data[0], length - 1);
+			std::vector<unsigned char> buf;
+			fwrite_s(fp, data(1, length - 1, buf), length - 1);
 		}
 	}
 
@@ -382,11 +362,18 @@ void MetaTag::write(FILE *fp) const {
 
 	// Check if there was some random extra data, and write it
 	if (extralen > 0) {
-		// Because the data isn't stored, we need to read it (from disk) 
-		std::vector<unsigned char> data ( extralen );
-		read_data(event->size() + metadata->size() + 2, &data[0], extralen);
+		fwrite_s(fp, &payload[extrapos], extralen);
+	}
+
+	// Pad out the rest of the tag
+	size_t used = extralen;
 
-		fwrite_s(fp, &data[0], extralen);
+	if ( length >= 2 )
+		used += event->size() + metadata->size() + 2;
+
+	if (length > used) {
+		std::vector<unsigned char> zeros ( length - used );
+		fwrite_s(fp, &zeros[0], zeros.size());
 	}
 
 	Tag::write_tail(fp);
@@ -400,10 +387,8 @@ void UndefinedTag::write(FILE *fp) const {
 
 	if (length > 0) {
 		// Because the data isn't stored, we need to read it (from disk) 
-		std::vector<unsigned char> data ( length );
-		read_data(0, &data[0], length );
-
-		fwrite_s(fp, &data[0], length);
+		std::vector<unsigned char> buf;
+		fwrite_s(fp, data(0, length, buf), length);
 	}
 
 	Tag::write_tail(fp);
@@ -435,6 +420,10 @@ void MetaTag::recalc_length() {
 	if (metadata.get()) 
 		length += (unsigned int)(metadata->size() + 1);
 
+	length += (unsigned int)padding;
+
+	if (length < minlength)
+		length = (unsigned int)minlength;
 }
 
 size_t UndefinedTag::size() const {
@@ -464,6 +453,17 @@ AMF *MetaTag::get(const char *key) const {
 	return metadata->get(key);
 }
 
+void MetaTag::setPadding(size_t padding) {
+	this->padding = padding;
+	recalc_length();
+}
+
+void MetaTag::keepLength() {
+	minlength = length;
+	extralen = 0;
+	recalc_length();
+}
+
 AudioTag::Codec AudioTag::getCodec() const {
 	return (Codec)((flags & 0xF0) >> 4);
 }
@@ -487,26 +487,33 @@ void VideoTag::readDimensions(unsigned int &width, unsigned int &height) const {
 	width = 0;
 	height = 0;
 
-	// Because the data isn't stored, we need to read it (from disk) 
-	std::vector<unsigned char> data ( length - 1 );
-	read_data(1, &data[0], length - 1);
-
 	switch ( getCodec() ) {
 		case VideoTag::SorensonH263: {
 
 			// |pictureStartCode|version|temporalReference|pictureSize|
 			// |    17 bits     | 5 bits|     8 bits      | 3 bits |
 
-			unsigned int pictureSize = read_N( &data[0], 30, 3 );
+			// read_N loads 4 bytes at a time, so make sure they are all in the tag
+			const unsigned char *d = picture;
+			size_t len = picturelen;
+
+			if ( len < 7 )
+				break;
+
+			unsigned int pictureSize = read_N( d, 30, 3 );
 
 			switch ( pictureSize ) {
 				case 0:
-					width = read_N( &data[0], 33, 8 );
-					height= read_N( &data[0], 41, 8 );
+					if ( len < 9 )
+						break;
+					width = read_N( d, 33, 8 );
+					height= read_N( d, 41, 8 );
 					break;
 				case 1:
-					width = read_N( &data[0], 33, 16 );
-					height= read_N( &data[0], 49, 16 );
+					if ( len < 10 )
+						break;
+					width = read_N( d, 33, 16 );
+					height= read_N( d, 49, 16 );
 					break;
 				case 2: width=352; height=288; break; // CIF
 				case 3: width=176; height=144; break; // QCIF
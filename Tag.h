@@ -7,10 +7,16 @@
 	If you wish to use this product for commercial reasons, then please contact us
 */
 
+#ifndef _TAG_H_
+#define _TAG_H_
+
 #include "common.h"
 #include "AMF.h"
+#include "ByteReader.h"
+#include "InputFile.h"
 
 #include <memory>
+#include <vector>
 #include <stdio.h>
 
 class TagHeader {
@@ -32,10 +38,10 @@ class TagHeader {
 			Audio = 0x04,
 		};
 
-		void read(FILE *fp);
+		void read(ByteReader &r);
 		void write(FILE *fp) const;
 
-		TagHeader(FILE *fp);
+		TagHeader(ByteReader &r);
 		TagHeader();
 
 		std::ostream& operator << (std::ostream& os) const;
@@ -53,16 +59,15 @@ class TagHeader {
 class Tag {
 
 		friend std::ostream& operator << (std::ostream& os, const Tag& tag);
-		friend Tag * fread_Tag(FILE *fp);
+		friend Tag * fread_Tag(ByteReader &r);
 		friend class FLVStream;
+		friend class TagTable;
 
 
 	protected:
 
-		const static int TAGHEADERLEN = 11;
-
 		// Position in the file this tag starts
-		FILE *fp;
+		const InputFile *in;
 		off_t filepos;
 
 		unsigned int length;
@@ -70,8 +75,11 @@ class Tag {
 
 		unsigned int reserved;
 
-		virtual void read(FILE *fp);
-		void read_tail(FILE *fp);
+		// True if the header no longer matches the one in the file
+		bool modified;
+
+		virtual void read(ByteReader &r);
+		void read_tail(ByteReader &r);
 
 		// We don't need a data field if we are storing a filepos (since we can read from the source again)
 		//std::auto_ptr<unsigned char> data;
@@ -79,7 +87,13 @@ class Tag {
 		// Reads the data from the original file, and places it into buf
 		size_t read_data(off_t offset, unsigned char *buf, size_t len) const;
 
+		// Returns len bytes of data, straight from the original file if it is mapped, otherwise read into buf
+		const unsigned char *data(off_t offset, size_t len, std::vector<unsigned char> &buf) const;
+
 	public:
+		// The length of a tag's header, the data comes after it, and then the 4 byte prev_length
+		const static int TAGHEADERLEN = 11;
+
 		enum Types {
 			Audio     = 0x08,
 			Video     = 0x09,
@@ -98,7 +112,7 @@ class Tag {
 		virtual size_t size() const;
 
 		unsigned int getTimestamp() const { return timestamp; };
-		void setTimestamp(unsigned int timestamp) { this->timestamp = timestamp; }; //TODO make sure the timestamp is within 24bits
+		void setTimestamp(unsigned int timestamp) { modified |= (timestamp != this->timestamp); this->timestamp = timestamp; }; //TODO make sure the timestamp is within 24bits
 
 		virtual std::ostream& operator << (std::ostream& os) const = 0;
 };
@@ -110,14 +124,14 @@ class AudioTag : public Tag {
 
 	public:
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual Types type() const { return Audio; };
 
-		AudioTag(FILE *fp);
+		AudioTag(ByteReader &r);
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 
@@ -135,6 +149,8 @@ class AudioTag : public Tag {
 		unsigned int getChannels() const;
 		unsigned int getSampleRate() const;
 
+		unsigned char getFlags() const { return (unsigned char)flags; };
+
 	private:
 		unsigned int flags;
 
@@ -162,14 +178,14 @@ class VideoTag : public Tag {
 			ScreenVideo2 = 6,
 		};
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual Types type() const { return Video; };
 
-		VideoTag(FILE *fp);
+		VideoTag(ByteReader &r);
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 
@@ -183,6 +199,12 @@ class VideoTag : public Tag {
 		FrameType frame_type;
 		Codec codec;
 
+		// The start of the data (after the flags), which holds the dimensions. It is kept as the tag is
+		// read, since the rest of the data isn't, and can't always be read again (such as from a pipe)
+		const static size_t PICTURE_LEN = 10;
+		unsigned char picture[PICTURE_LEN];
+		size_t picturelen;
+
 		void readDimensions(unsigned int &width, unsigned int &height) const;
 
 };
@@ -190,23 +212,33 @@ class VideoTag : public Tag {
 class MetaTag : public Tag {
 	
 	private:
+		// The tag's data as read, the AMF strings below point into it
+		std::vector<unsigned char> payload;
+
 		std::auto_ptr<AMFString> event;
 		std::auto_ptr<AMFMap> metadata;
 
-		// If there is extra data after the meta tags
+		// If there is extra data after the meta tags, and where it is in the tag's data
 		size_t extralen;
+		size_t extrapos;
+
+		// Zero bytes written after the meta data, so it has room to grow in place later
+		size_t padding;
+
+		// The tag's data is padded out to at least this length
+		size_t minlength;
 
 		void recalc_length();
 	public:
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual Types type() const { return Meta; };
 
-		MetaTag(FILE *fp);
+		MetaTag(ByteReader &r);
 		MetaTag(const char *name);
 
 		// Removes this key
@@ -218,6 +250,13 @@ class MetaTag : public Tag {
 		// Gets this key		
 		AMF *get(const char *key) const;
 
+		// Leaves padding bytes spare after the meta data
+		void setPadding(size_t padding);
+
+		// Keeps the tag at least its current length, so it can be overwritten in place
+		// Any extra data after the meta data is turned into padding
+		void keepLength();
+
 		virtual std::ostream& operator << (std::ostream& os) const;
 };
 
@@ -225,16 +264,18 @@ class UndefinedTag : public Tag {
 
 	public:
 
-		virtual void read(FILE *fp);
+		virtual void read(ByteReader &r);
 		virtual void write(FILE *fp) const;
 
 		virtual size_t size() const;
 
 		virtual Types type() const { return Undefined; };
 
-		UndefinedTag(FILE *fp);
+		UndefinedTag(ByteReader &r);
 
 		virtual std::ostream& operator << (std::ostream& os) const;
 };
 
-class Tag * fread_Tag(FILE *fp);
+class Tag * fread_Tag(ByteReader &r);
+
+#endif
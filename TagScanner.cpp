@@ -0,0 +1,365 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "TagScanner.h"
+#include "ByteReader.h"
+#include "Thread.h"
+#include "Functors.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+using std::auto_ptr;
+using std::vector;
+
+// How many tags in a row must agree, before we believe we have found a tag
+#define CHAIN_LENGTH 3
+
+// Returns the index of the first byte that could be the type of a audio, video or meta data tag, or len if there are none
+static size_t findTypeByte(const unsigned char *d, size_t len) {
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i audio = _mm_set1_epi8( Tag::Audio );
+	const __m128i video = _mm_set1_epi8( Tag::Video );
+	const __m128i meta  = _mm_set1_epi8( Tag::Meta );
+
+	// Compare 16 bytes at a time, and leave the loop below to find which one it was
+	for ( ; i + 16 <= len; i += 16 ) {
+		__m128i v = _mm_loadu_si128( (const __m128i *)(d + i) );
+		__m128i m = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8(v, audio), _mm_cmpeq_epi8(v, video) ), _mm_cmpeq_epi8(v, meta) );
+
+		if ( _mm_movemask_epi8(m) != 0 )
+			break;
+	}
+#endif
+
+	for ( ; i < len; i++ ) {
+		if ( d[i] == Tag::Audio || d[i] == Tag::Video || d[i] == Tag::Meta )
+			return i;
+	}
+
+	return len;
+}
+
+/**
+	Looks for tags at any position in a file
+*/
+class TagProbe {
+
+	public:
+
+		TagProbe(const InputFile &in) : in(in) {}
+
+		// Reads len bytes at pos, returns false if they are past the end of the file
+		bool readAt(off_t pos, unsigned char *buf, size_t len);
+
+		// Checks there is a tag at pos, and that chain tags in a row (or up to the end of the file) agree
+		// with each other. The first tag must be audio, video or meta data, unless anytype is set
+		bool isTag(off_t pos, unsigned int chain, bool anytype = false);
+
+		// Returns the first tag that starts between begin and end, or -1
+		off_t findTag(off_t begin, off_t end, unsigned int chain);
+
+	private:
+
+		const InputFile &in;
+};
+
+bool TagProbe::readAt(off_t pos, unsigned char *buf, size_t len) {
+
+	if ( pos < 0 || pos + (off_t)len > in.size() )
+		return false;
+
+	if ( in.isMapped() ) {
+		memcpy(buf, in.data(pos, len), len);
+		return true;
+	}
+
+	in.read(pos, buf, len);
+	return true;
+}
+
+bool TagProbe::isTag(off_t pos, unsigned int chain, bool anytype) {
+
+	unsigned int depth = 0;
+
+	while ( depth < chain ) {
+
+		if ( pos == in.size() )
+			return depth > 0;
+
+		unsigned char h[Tag::TAGHEADERLEN];
+
+		if ( !readAt(pos, h, sizeof(h)) )
+			return false;
+
+		// We only start on audio, video or meta data tags, but there may be anything after them
+		if ( depth == 0 && !anytype && h[0] != Tag::Audio && h[0] != Tag::Video && h[0] != Tag::Meta )
+			return false;
+
+		unsigned int length = (h[1] << 16) | (h[2] << 8) | h[3];
+
+		unsigned char t[4];
+
+		if ( !readAt(pos + Tag::TAGHEADERLEN + length, t, 4) )
+			return false;
+
+		if ( (unsigned int)((t[0] << 24) | (t[1] << 16) | (t[2] << 8) | t[3]) != length + Tag::TAGHEADERLEN )
+			return false;
+
+		pos += Tag::TAGHEADERLEN + length + 4;
+		depth++;
+	}
+
+	return true;
+}
+
+off_t TagProbe::findTag(off_t begin, off_t end, unsigned int chain) {
+
+	vector<unsigned char> buf;
+	off_t pos = begin;
+
+	end = std::min( end, in.size() );
+
+	while ( pos < end ) {
+		size_t len = (size_t) std::min( (off_t)(64 * 1024), end - pos );
+		const unsigned char *d = NULL;
+
+		// Search the mapping in place, otherwise a block at a time
+		if ( in.isMapped() ) {
+			d = in.data(pos, len);
+
+		} else {
+			buf.resize( len );
+
+			if ( !readAt(pos, &buf[0], len) )
+				return -1;
+
+			d = &buf[0];
+		}
+
+		size_t i = 0;
+
+		while ( (i += findTypeByte(d + i, len - i)) < len ) {
+			if ( isTag(pos + (off_t)i, chain) )
+				return pos + (off_t)i;
+
+			i++;
+		}
+
+		pos += len;
+	}
+
+	return -1;
+}
+
+/**
+	Reads the tags that start in one chunk of the file
+*/
+class ScanWorker : public Thread {
+
+	public:
+
+		// The chunk
+		off_t begin;
+		off_t end;
+
+		// The tags found, where the first one starts (-1 if none), and where the last one ends
+		TagTable tags;
+		off_t first;
+		off_t stop;
+
+		// Set if anything went wrong
+		bool failed;
+		std::string error;
+
+		ScanWorker(const InputFile &in, off_t begin, off_t end)
+			: begin(begin), end(end), first(-1), stop(-1), failed(false), in(in) {}
+
+	protected:
+
+		virtual void run();
+
+	private:
+
+		// Shared with the other workers, its reads don't use the file position
+		const InputFile &in;
+};
+
+void ScanWorker::run() {
+
+	try {
+		TagProbe probe ( in );
+		first = probe.findTag(begin, end, CHAIN_LENGTH);
+
+		if ( first < 0 )
+			return;
+
+		auto_ptr<ByteReader> r;
+
+		if ( in.isMapped() ) {
+			r.reset( new ByteReader( in.data(first, (size_t)(in.size() - first)), (size_t)(in.size() - first), first ) );
+
+		} else {
+			r.reset( new ByteReader( in.file(), first ) );
+
+			// Only up to the end of our chunk, the last tag is read past it as usual
+			r->readAhead(end);
+		}
+
+		r->setSource( &in );
+
+		stop = TagScanner::scanRange(*r, end, tags);
+
+	} catch ( const std::exception &e ) {
+		failed = true;
+		error = e.what();
+	}
+}
+
+TagScanner::TagScanner(const InputFile &in, off_t start) : in(in), start(start) {}
+
+off_t TagScanner::scanRange(ByteReader &r, off_t end, TagTable &tags) {
+
+	while ( r.tell() < end ) {
+		auto_ptr<Tag> tag ( fread_Tag(r) );
+
+		if ( tag.get() == NULL )
+			break;
+
+		tags.push_back( *tag );
+	}
+
+	return r.tell();
+}
+
+void TagScanner::scan(TagTable &tags, unsigned int threads) {
+
+	off_t len = in.size() - start;
+
+	// A unnamed file (a spooled stdin) can't be opened again by each thread
+	if ( !in.isMapped() && in.isStdin() )
+		threads = 1;
+
+	threads = (unsigned int) std::max( (off_t)1, std::min( (off_t)threads, len / MIN_CHUNK ) );
+
+	auto_ptr<ByteReader> r ( in.reader() );
+
+	if ( threads <= 1 ) {
+		r->skip(start);
+		r->readAhead(in.size());
+		scanRange(*r, in.size(), tags);
+		return;
+	}
+
+	// Split the file into equal chunks, and scan each one in its own thread
+	vector<ScanWorker *> workers;
+
+	try {
+		for ( unsigned int i = 0; i < threads; i++ ) {
+			off_t b = start + len * i / threads;
+			off_t e = (i + 1 == threads) ? in.size() : start + len * (i + 1) / threads;
+
+			workers.push_back( new ScanWorker(in, b, e) );
+			workers.back()->start();
+		}
+
+	} catch ( ... ) {
+		for ( size_t i = 0; i < workers.size(); i++ )
+			workers[i]->join();
+
+		std::for_each( workers.begin(), workers.end(), DeleteObject() );
+		throw;
+	}
+
+	for ( size_t i = 0; i < workers.size(); i++ )
+		workers[i]->join();
+
+	// Now join the chunks, each must start where the last one stopped
+	off_t expected = start;
+
+	try {
+		for ( size_t i = 0; i < workers.size(); i++ ) {
+			ScanWorker *w = workers[i];
+
+			// A tag from a earlier chunk covers all of this one
+			if ( expected >= w->end )
+				continue;
+
+			if ( !w->failed && w->first == expected ) {
+				tags.append( w->tags );
+				expected = w->stop;
+
+			} else {
+				// The thread found the wrong place to start (or hit a error), so read this chunk again from the right place
+				r->skip( expected - r->tell() );
+				expected = scanRange( *r, w->end, tags );
+			}
+
+			// Keep our reader where the next chunk should start
+			if ( expected > r->tell() )
+				r->skip( expected - r->tell() );
+		}
+
+	} catch ( ... ) {
+		std::for_each( workers.begin(), workers.end(), DeleteObject() );
+		throw;
+	}
+
+	std::for_each( workers.begin(), workers.end(), DeleteObject() );
+}
+
+void TagScanner::recover(TagTable &tags, std::vector< std::pair<off_t, off_t> > &skipped) {
+
+	TagProbe probe ( in );
+	auto_ptr<ByteReader> r ( in.reader() );
+
+	off_t pos = start;
+
+	while ( pos < in.size() ) {
+
+		// While we are in step, any tag whose length agrees with its prev_length is read
+		if ( probe.isTag(pos, 1, true) ) {
+			try {
+				r->skip( pos - r->tell() );
+
+				auto_ptr<Tag> tag ( fread_Tag(*r) );
+
+				if ( tag.get() == NULL )
+					break;
+
+				tags.push_back( *tag );
+				pos = r->tell();
+				continue;
+
+			} catch ( const std::runtime_error & ) {
+				// The tag didn't parse, so treat it as junk. The reader is somewhere inside it, so start again
+				r.reset( in.reader() );
+			}
+		}
+
+		// Otherwise look for the next place a few tags in a row agree
+		off_t next = probe.findTag(pos + 1, in.size(), CHAIN_LENGTH);
+
+		if ( next < 0 )
+			next = in.size();
+
+		skipped.push_back( std::make_pair(pos, next - pos) );
+		pos = next;
+	}
+}
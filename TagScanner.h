@@ -0,0 +1,57 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _TAGSCANNER_H_
+#define _TAGSCANNER_H_
+
+#include "TagTable.h"
+#include "InputFile.h"
+
+#include <vector>
+#include <utility>
+
+/**
+	Reads all the tags of a file into a TagTable, using a thread per chunk of the file.
+	Each thread finds the first tag in its chunk (a type byte, whose length and prev_length
+	agree, followed by a few more tags that agree), and reads every tag that starts in
+	the chunk. The tables are then joined, checking each chunk starts exactly where the
+	one before it ended. A chunk that doesn't is read again from the right place.
+	The result is the same as reading the file from start to end with fread_Tag.
+
+	The same search for tags is used to recover damaged files, by skipping from a bad
+	tag to the next place that some tags in a row agree
+*/
+class TagScanner {
+
+	public:
+
+		// Files are not split into chunks smaller than this
+		const static off_t MIN_CHUNK = 16 * 1024 * 1024;
+
+		// The tags start at offset start in the file
+		TagScanner(const InputFile &in, off_t start);
+
+		// Adds all the tags onto the end of tags, using up to threads threads
+		void scan(TagTable &tags, unsigned int threads);
+
+		// Adds all the tags onto the end of tags, skipping over anything that is not a tag.
+		// The junk that was skipped is added to skipped, as (offset, length) pairs
+		void recover(TagTable &tags, std::vector< std::pair<off_t, off_t> > &skipped);
+
+		// Reads the tags from r onwards, until one starts at or after end (or the end of file)
+		// Returns the position after the last tag read
+		static off_t scanRange(ByteReader &r, off_t end, TagTable &tags);
+
+	private:
+
+		const InputFile &in;
+		off_t start;
+};
+
+#endif
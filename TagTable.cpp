@@ -0,0 +1,303 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "TagTable.h"
+
+#include <algorithm>
+#include <assert.h>
+
+void TagTable::reserve(size_t n) {
+	offsets.reserve(n);
+	lengths.reserve(n);
+	timestamps.reserve(n);
+	types.reserve(n);
+	infos.reserve(n);
+	rowflags.reserve(n);
+}
+
+void TagTable::clear() {
+	offsets.clear();
+	lengths.clear();
+	timestamps.clear();
+	types.clear();
+	infos.clear();
+	rowflags.clear();
+	runs.clear();
+}
+
+// Returns the first byte of a audio or video tag's data
+static unsigned char tagInfo(const Tag &tag) {
+	switch ( tag.type() ) {
+		case Tag::Audio:
+			return static_cast<const AudioTag &>(tag).getFlags();
+
+		case Tag::Video: {
+			const VideoTag &v = static_cast<const VideoTag &>(tag);
+			return (unsigned char)( (v.getFrameType() << 4 & 0xf0) | (v.getCodec() & 0x0f) );
+		}
+
+		default:
+			return 0;
+	}
+}
+
+void TagTable::push_back(off_t filepos, unsigned int length, unsigned int timestamp, unsigned char type, unsigned char info, unsigned char flags) {
+	offsets.push_back(filepos);
+	lengths.push_back(length);
+	timestamps.push_back(timestamp);
+	types.push_back(type);
+	infos.push_back(info);
+	rowflags.push_back(flags);
+}
+
+void TagTable::push_source(const InputFile *in) {
+	if ( runs.empty() || runs.back().in != in ) {
+		Run r = { size(), in };
+		runs.push_back(r);
+	}
+}
+
+void TagTable::push_back(const Tag &tag, unsigned char flags) {
+
+	if ( tag.reserved != 0 )
+		flags |= Reserved;
+
+	if ( tag.modified )
+		flags |= Modified;
+
+	push_source( (flags & Object) ? NULL : tag.in );
+	push_back(tag.filepos, tag.length, tag.timestamp, (unsigned char)tag.type(), tagInfo(tag), flags);
+}
+
+void TagTable::push_back(const TagTable &table, size_t i) {
+
+	assert ( i < table.size() );
+
+	push_source( table.source(i) );
+	push_back(table.offsets[i], table.lengths[i], table.timestamps[i], table.types[i], table.infos[i], table.rowflags[i]);
+}
+
+void TagTable::append(const TagTable &table) {
+
+	size_t base = size();
+
+	offsets.insert(offsets.end(), table.offsets.begin(), table.offsets.end());
+	lengths.insert(lengths.end(), table.lengths.begin(), table.lengths.end());
+	timestamps.insert(timestamps.end(), table.timestamps.begin(), table.timestamps.end());
+	types.insert(types.end(), table.types.begin(), table.types.end());
+	infos.insert(infos.end(), table.infos.begin(), table.infos.end());
+	rowflags.insert(rowflags.end(), table.rowflags.begin(), table.rowflags.end());
+
+	std::vector<Run>::const_iterator i = table.runs.begin();
+
+	for ( ; i != table.runs.end(); ++i ) {
+		if ( runs.empty() || runs.back().in != (*i).in ) {
+			Run r = { base + (*i).start, (*i).in };
+			runs.push_back(r);
+		}
+	}
+}
+
+void TagTable::insert(size_t pos, const Tag &tag, unsigned char flags) {
+
+	assert ( pos <= size() );
+
+	if ( pos == size() ) {
+		push_back(tag, flags);
+		return;
+	}
+
+	if ( tag.reserved != 0 )
+		flags |= Reserved;
+
+	if ( tag.modified )
+		flags |= Modified;
+
+	const InputFile *in = (flags & Object) ? NULL : tag.in;
+
+	offsets.insert(offsets.begin() + pos, tag.filepos);
+	lengths.insert(lengths.begin() + pos, tag.length);
+	timestamps.insert(timestamps.begin() + pos, tag.timestamp);
+	types.insert(types.begin() + pos, (unsigned char)tag.type());
+	infos.insert(infos.begin() + pos, tagInfo(tag));
+	rowflags.insert(rowflags.begin() + pos, flags);
+
+	// Fix up the runs, everything after pos moves along one
+	size_t r = run(pos);
+
+	for (size_t j = r + 1; j < runs.size(); j++)
+		runs[j].start++;
+
+	if ( runs[r].in == in )
+		return;
+
+	if ( runs[r].start == pos ) {
+		// Join onto the end of the previous run if we can
+		if ( r > 0 && runs[r - 1].in == in ) {
+			runs[r].start++;
+			return;
+		}
+
+		Run n = { pos, in };
+		runs[r].start++;
+		runs.insert(runs.begin() + r, n);
+		return;
+	}
+
+	// Split the run around the new row
+	Run n = { pos, in };
+	Run rest = { pos + 1, runs[r].in };
+
+	runs.insert(runs.begin() + r + 1, rest);
+	runs.insert(runs.begin() + r + 1, n);
+}
+
+void TagTable::erase(size_t begin, size_t end) {
+
+	assert ( begin <= end );
+	assert ( end <= size() );
+
+	if ( begin == end )
+		return;
+
+	offsets.erase(offsets.begin() + begin, offsets.begin() + end);
+	lengths.erase(lengths.begin() + begin, lengths.begin() + end);
+	timestamps.erase(timestamps.begin() + begin, timestamps.begin() + end);
+	types.erase(types.begin() + begin, types.begin() + end);
+	infos.erase(infos.begin() + begin, infos.begin() + end);
+	rowflags.erase(rowflags.begin() + begin, rowflags.begin() + end);
+
+	// Move the runs, any that started inside the erased rows now start at begin
+	size_t removed = end - begin;
+	std::vector<Run>::iterator i;
+
+	for (i = runs.begin(); i != runs.end(); ++i) {
+		if ( i->start >= end )
+			i->start -= removed;
+		else if ( i->start > begin )
+			i->start = begin;
+	}
+
+	// Now drop the runs that have no rows left, and join any neighbours from the same file
+	std::vector<Run> old;
+	old.swap(runs);
+
+	for (size_t j = 0; j < old.size(); j++) {
+		size_t next = (j + 1 < old.size()) ? old[j + 1].start : size();
+
+		if ( old[j].start >= next )
+			continue;
+
+		if ( !runs.empty() && runs.back().in == old[j].in )
+			continue;
+
+		runs.push_back(old[j]);
+	}
+}
+
+void TagTable::setTimestamp(size_t i, unsigned int timestamp) {
+	if ( timestamps[i] != timestamp ) {
+		timestamps[i] = timestamp;
+		rowflags[i] |= Modified;
+	}
+}
+
+size_t TagTable::lowerBound(unsigned int timestamp, size_t begin, size_t end) const {
+	return std::lower_bound(timestamps.begin() + begin, timestamps.begin() + end, timestamp) - timestamps.begin();
+}
+
+unsigned int TagTable::reserved(size_t i) const {
+
+	if ( (rowflags[i] & Reserved) == 0 )
+		return 0;
+
+	// It is rare for this not to be zero, so we don't keep it, and read it from the file instead
+	const InputFile *in = source(i);
+	assert ( in != NULL );
+
+	unsigned char b[4];
+	in->read(offsets[i] + 7, b, 4);
+
+	return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+size_t TagTable::run(size_t i) const {
+
+	assert ( !runs.empty() );
+
+	// Binary search for the last run that starts at or before i
+	size_t lo = 0;
+	size_t hi = runs.size();
+
+	while ( hi - lo > 1 ) {
+		size_t mid = (lo + hi) / 2;
+
+		if ( runs[mid].start <= i )
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+const InputFile *TagTable::source(size_t i) const {
+
+	assert ( i < size() );
+
+	return runs[ run(i) ].in;
+}
+
+void TagTable::setSource(const InputFile *from, const InputFile *to) {
+
+	std::vector<Run>::iterator i = runs.begin();
+
+	for ( ; i != runs.end(); ++i ) {
+		if ( (*i).in == from )
+			(*i).in = to;
+	}
+}
+
+Tag *TagTable::read(size_t i) const {
+
+	const InputFile *in = source(i);
+
+	if ( in == NULL )
+		throw std::runtime_error( "this tag is not stored in a file" );
+
+	// Read the whole tag, and then parse it from memory
+	std::vector<unsigned char> buf;
+	const unsigned char *d = in->data(offsets[i], (size_t)size(i));
+
+	if ( d == NULL ) {
+		buf.resize( (size_t)size(i) );
+		in->read(offsets[i], &buf[0], buf.size());
+		d = &buf[0];
+	}
+
+	ByteReader r ( d, (size_t)size(i), offsets[i] );
+	r.setSource( in );
+
+	Tag *tag = fread_Tag( r );
+	assert ( tag != NULL );
+
+	tag->setTimestamp( timestamps[i] );
+
+	return tag;
+}
+
+void TagTable::writeHeader(FILE *fp, size_t i) const {
+
+	assert(fp != NULL);
+
+	fwrite_8(fp, types[i]);
+	fwrite_24(fp, lengths[i]);
+	fwrite_24(fp, timestamps[i]);
+	fwrite_32(fp, reserved(i));
+}
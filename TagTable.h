@@ -0,0 +1,119 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _TAGTABLE_H_
+#define _TAGTABLE_H_
+
+#include "Tag.h"
+
+#include <vector>
+
+/**
+	A compact table of all the tags in a stream. Instead of a heap allocated Tag
+	per row, each field is kept in its own array, which costs about 19 bytes a tag
+	and keeps the loops over all tags (keyframes, cropping, etc) cache friendly.
+	The tag's data stays in the file, and a full Tag can be read back with read()
+*/
+class TagTable {
+
+	public:
+
+		enum Flags {
+			Modified = 0x01, // The header no longer matches the one in the file
+			Reserved = 0x02, // The reserved field is not zero, so has to be read from the file
+			Object   = 0x04, // The tag is kept as a object (ie the meta data tag) and not copied from the file
+		};
+
+		size_t size() const { return offsets.size(); };
+		bool empty() const { return offsets.empty(); };
+
+		void reserve(size_t n);
+		void clear();
+
+		// Adds tag onto the end
+		void push_back(const Tag &tag, unsigned char flags = 0);
+
+		// Adds row i of table onto the end
+		void push_back(const TagTable &table, size_t i);
+
+		// Adds all of table onto the end
+		void append(const TagTable &table);
+
+		// Inserts tag before row pos
+		void insert(size_t pos, const Tag &tag, unsigned char flags = 0);
+
+		// Removes the rows from begin up to (but not including) end
+		void erase(size_t begin, size_t end);
+
+		Tag::Types type(size_t i) const { return (Tag::Types)types[i]; };
+		off_t filepos(size_t i) const { return offsets[i]; };
+		unsigned int length(size_t i) const { return lengths[i]; };
+		unsigned int timestamp(size_t i) const { return timestamps[i]; };
+		unsigned char flags(size_t i) const { return rowflags[i]; };
+
+		// Size of the tag in the file (including the header and prev_length)
+		off_t size(size_t i) const { return (off_t)lengths[i] + 15; };
+
+		void setTimestamp(size_t i, unsigned int timestamp);
+		void setFlags(size_t i, unsigned char flags) { rowflags[i] = flags; };
+
+		// The reserved field in the tag's header
+		unsigned int reserved(size_t i) const;
+
+		// Information from the first byte of a audio or video tag's data
+		AudioTag::Codec audioCodec(size_t i) const { return (AudioTag::Codec)((infos[i] & 0xF0) >> 4); };
+		VideoTag::Codec videoCodec(size_t i) const { return (VideoTag::Codec)(infos[i] & 0x0F); };
+		VideoTag::FrameType frameType(size_t i) const { return (VideoTag::FrameType)(infos[i] >> 4); };
+
+		bool isKeyFrame(size_t i) const { return types[i] == Tag::Video && frameType(i) == VideoTag::KeyFrame; };
+
+		// Returns the first row from begin to end with a timestamp of at least timestamp (or end)
+		// The timestamps in that range must not go backwards
+		size_t lowerBound(unsigned int timestamp, size_t begin, size_t end) const;
+
+		// The file this row's data is in (NULL for a object)
+		const InputFile *source(size_t i) const;
+
+		// Changes the rows that are in the file from, to be in the file to
+		void setSource(const InputFile *from, const InputFile *to);
+
+		// Reads this row back from its file, the caller must delete the returned Tag
+		Tag *read(size_t i) const;
+
+		// Writes the 11 byte header of row i
+		void writeHeader(FILE *fp, size_t i) const;
+
+	private:
+
+		// Saves and loads the columns as they are
+		friend class ScanCache;
+
+		std::vector<off_t> offsets;
+		std::vector<unsigned int> lengths;
+		std::vector<unsigned int> timestamps;
+		std::vector<unsigned char> types;
+		std::vector<unsigned char> infos;
+		std::vector<unsigned char> rowflags;
+
+		// Rows that come from the same file are stored as a run, starting at row start
+		struct Run {
+			size_t start;
+			const InputFile *in;
+		};
+
+		std::vector<Run> runs;
+
+		void push_back(off_t filepos, unsigned int length, unsigned int timestamp, unsigned char type, unsigned char info, unsigned char flags);
+		void push_source(const InputFile *in);
+
+		// Returns the run that holds row i
+		size_t run(size_t i) const;
+};
+
+#endif
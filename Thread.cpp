@@ -0,0 +1,100 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#include "Thread.h"
+#include "common.h"
+
+#include <assert.h>
+
+#ifndef WIN32
+	#include <unistd.h>
+#endif
+
+Thread::Thread() : started(false) {}
+
+Thread::~Thread() {
+	assert ( !started );
+}
+
+#ifndef WIN32
+
+void *Thread::entry(void *arg) {
+	static_cast<Thread *>(arg)->run();
+	return NULL;
+}
+
+void Thread::start() {
+	assert ( !started );
+
+	int err = pthread_create(&thread, NULL, entry, this);
+
+	if (err != 0)
+		throw vargs_exception( "%s:%d: pthread_create failed errno(%d)", __FILE__, __LINE__, err);
+
+	started = true;
+}
+
+void Thread::join() {
+	if ( !started )
+		return;
+
+	pthread_join(thread, NULL);
+	started = false;
+}
+
+unsigned int Thread::cpus() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned int)n : 1;
+}
+
+Mutex::Mutex() {
+	int err = pthread_mutex_init(&mutex, NULL);
+
+	if (err != 0)
+		throw vargs_exception( "%s:%d: pthread_mutex_init failed errno(%d)", __FILE__, __LINE__, err);
+}
+
+Mutex::~Mutex() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void Mutex::lock() {
+	pthread_mutex_lock(&mutex);
+}
+
+void Mutex::unlock() {
+	pthread_mutex_unlock(&mutex);
+}
+
+#else
+
+void Thread::start() {
+	assert ( !started );
+	started = true;
+}
+
+void Thread::join() {
+	if ( !started )
+		return;
+
+	started = false;
+	run();
+}
+
+unsigned int Thread::cpus() {
+	return 1;
+}
+
+Mutex::Mutex() {}
+Mutex::~Mutex() {}
+
+void Mutex::lock() {}
+void Mutex::unlock() {}
+
+#endif
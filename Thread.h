@@ -0,0 +1,99 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+	
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+*/
+
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#ifndef WIN32
+	#include <pthread.h>
+#endif
+
+/**
+	A very small thread wrapper, subclasses put their work in run().
+	On platforms without pthreads, run() is simply called from join()
+*/
+class Thread {
+
+	public:
+
+		Thread();
+		virtual ~Thread();
+
+		// Starts run() in a new thread
+		void start();
+
+		// Waits for run() to finish
+		void join();
+
+		// How many CPUs we can run on
+		static unsigned int cpus();
+
+	protected:
+
+		virtual void run() = 0;
+
+	private:
+
+#ifndef WIN32
+		pthread_t thread;
+
+		static void *entry(void *arg);
+#endif
+
+		bool started;
+
+		// Not copyable
+		Thread(const Thread &);
+		Thread & operator = (const Thread &);
+};
+
+/**
+	A mutex, on platforms without pthreads there is only ever one thread, so it does nothing
+*/
+class Mutex {
+
+	public:
+
+		Mutex();
+		~Mutex();
+
+		void lock();
+		void unlock();
+
+	private:
+
+#ifndef WIN32
+		pthread_mutex_t mutex;
+#endif
+
+		// Not copyable
+		Mutex(const Mutex &);
+		Mutex & operator = (const Mutex &);
+};
+
+/**
+	Holds a Mutex locked until it goes out of scope
+*/
+class MutexLock {
+
+	public:
+
+		MutexLock(Mutex &mutex) : mutex(mutex) { mutex.lock(); };
+		~MutexLock() { mutex.unlock(); };
+
+	private:
+
+		Mutex &mutex;
+
+		// Not copyable
+		MutexLock(const MutexLock &);
+		MutexLock & operator = (const MutexLock &);
+};
+
+#endif
@@ -13,6 +13,18 @@
 
 #include <stdarg.h>
 #include <errno.h>
+#include <string.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#ifdef WIN32
+	#include <time.h>
+#else
+	#include <unistd.h>
+	#include <sys/time.h>
+#endif
 
 vargs_exception::vargs_exception(const char * message, ...) : runtime_error("") {
 	va_list args;
@@ -49,8 +61,38 @@ void endian_swap64(unsigned char b[8]) {
 	}
 }
 
+void endian_swap64s(unsigned char *out, size_t stride, const double *d, size_t n) {
+
+	assert ( stride >= 8 );
+
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Two at a time, swap the bytes in each 16 bit word, then reverse the words in each 64 bit half
+	for ( ; i + 2 <= n; i += 2 ) {
+		__m128i v = _mm_loadu_si128( (const __m128i *)(d + i) );
+
+		v = _mm_or_si128( _mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8) );
+		v = _mm_shufflelo_epi16( v, _MM_SHUFFLE(0, 1, 2, 3) );
+		v = _mm_shufflehi_epi16( v, _MM_SHUFFLE(0, 1, 2, 3) );
+
+		_mm_storel_epi64( (__m128i *)out, v );
+		_mm_storel_epi64( (__m128i *)(out + stride), _mm_unpackhi_epi64(v, v) );
+
+		out += 2 * stride;
+	}
+#endif
+
+	for ( ; i < n; i++ ) {
+		memcpy(out, d + i, 8);
+		endian_swap64(out);
+
+		out += stride;
+	}
+}
+
 // Reads N bits, from a certain offset
-unsigned int read_N(unsigned char *data, unsigned int offset, unsigned int bits) {
+unsigned int read_N(const unsigned char *data, unsigned int offset, unsigned int bits) {
 
 	assert( bits > 0 );
 	assert( ( (offset % 8) + bits ) <= 32 );
@@ -60,22 +102,13 @@ unsigned int read_N(unsigned char *data, unsigned int offset, unsigned int bits)
 	offset -= (offset / 8) * 8;
 
 	// Make sure the data is in Big Endian (TODO don't do this swap on big machines)
-	unsigned int d = endian_swap32( *((unsigned int *)data) );
+	unsigned int d = endian_swap32( *((const unsigned int *)data) );
 
-	// Create a mask that has bit 1s in the left hand column
-	unsigned int mask = ~ ( (0x80000000 >> (bits-1)) - 1 );
+	// Shift the bits we want down to the bottom, and mask off the ones before them
+	unsigned int ret = d >> (32 - offset - bits);
 
-	//1101 0100 1000 00010100000000000000
-    //0000 0011 1000      mask 0x38
-	//0000 0000 1000 0000 ret
-	//0010 0000 0000 0000
-	//0000 0000 0010 0000
-
-	// Now mask off the correct bits, and move the result along
-	unsigned int ret = endian_swap32( ( d & (mask >> offset) ) << offset );
-
-	// Make sure we don't return a value too big
-	assert( ret <= ((unsigned int)0x1 >> bits) );
+	if ( bits < 32 )
+		ret &= ( 1u << bits ) - 1;
 
 	return ret;
 }
@@ -130,6 +163,36 @@ void fread_s(FILE *fp, char *data, size_t len) {
 		throw std::runtime_error("could not read requested bytes");
 }
 
+size_t fread_at(FILE *fp, off_t offset, unsigned char *data, size_t len) {
+
+#ifdef WIN32
+	if (fseeko(fp, offset, SEEK_SET))
+		throw vargs_exception( "%s:%d: fseeko failed errno(%d)", __FILE__, __LINE__, errno );
+
+	return fread(data, 1, len, fp);
+#else
+	int fd = fileno(fp);
+	size_t done = 0;
+
+	while ( done < len ) {
+		ssize_t ret = pread(fd, data + done, len - done, offset + (off_t)done);
+
+		if ( ret > 0 ) {
+			done += (size_t)ret;
+			continue;
+		}
+
+		if ( ret == 0 )
+			break;
+
+		if ( errno != EINTR )
+			throw vargs_exception( "%s:%d: pread failed errno(%d)", __FILE__, __LINE__, errno );
+	}
+
+	return done;
+#endif
+}
+
 void fwrite_8(FILE *fp, unsigned char t) {
 	if (fwrite(&t, 1, 1, fp) < 1)
 		throw std::runtime_error("could not write requested bytes");
@@ -173,3 +236,13 @@ void fwrite_s(FILE *fp, const char *data, size_t len) {
 		throw std::runtime_error("could not write requested bytes");
 }
 
+double wall_seconds() {
+#ifdef WIN32
+	// clock() is wall time on windows
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
@@ -7,6 +7,9 @@
 	If you wish to use this product for commercial reasons, then please contact us
 */
 
+#ifndef _COMMON_H_
+#define _COMMON_H_
+
 #include <stdio.h>
 #include <stdexcept>
 
@@ -40,8 +43,11 @@ unsigned int endian_swap32(unsigned int x);
 unsigned short endian_swap16(unsigned short x);
 void endian_swap64(unsigned char b[8]);
 
+// Stores n doubles big endian into out, each one stride (>= 8) bytes after the last
+void endian_swap64s(unsigned char *out, size_t stride, const double *d, size_t n);
+
 // Reads N bits, from a certain offset
-unsigned int read_N(unsigned char *data, unsigned int offset, unsigned int bits);
+unsigned int read_N(const unsigned char *data, unsigned int offset, unsigned int bits);
 unsigned char fread_8(FILE *fp) ;
 unsigned short fread_16(FILE *fp);
 unsigned int fread_24(FILE *fp);
@@ -50,6 +56,10 @@ double fread_64(FILE *fp);
 
 void fread_s(FILE *fp, unsigned char *data, size_t len);
 void fread_s(FILE *fp, char *data, size_t len);
+
+// Reads up to len bytes at offset in fp, returning how many (less only at the end of the file)
+// This doesn't use or move fp's position, so many threads can read the same fp at once (except on WIN32)
+size_t fread_at(FILE *fp, off_t offset, unsigned char *data, size_t len);
 void fwrite_8(FILE *fp, unsigned char t);
 void fwrite_16(FILE *fp, unsigned short i);
 void fwrite_24(FILE *fp, unsigned int i);
@@ -58,3 +68,8 @@ void fwrite_64(FILE *fp, double d);
 
 void fwrite_s(FILE *fp, const unsigned char *data, size_t len);
 void fwrite_s(FILE *fp, const char *data, size_t len);
+
+// Seconds since some fixed point in the past, for timing things
+double wall_seconds();
+
+#endif
@@ -17,13 +17,18 @@
 	TODO more documentation ;)
 	TODO change the command line arguments to give more flexibility. Ie chop/join without adding meta data
 	TODO when merging file carry across metadata
-	TODO split FLV files
 	TODO add more methods on audio/video tags to obtain codec, rates, sizes, etc
 
 	WARNING: FLV files can't index over 2^53 bytes, since the indexs are stored as doubles, and doubles lose int precession
 */
 
 #include "FLV.h"
+#include "Thread.h"
+#include "ReadAhead.h"
+#include "IoUring.h"
+#include "Batch.h"
+#include "ScanCache.h"
+#include "KeyFrameIndex.h"
 //#include "Tag.h"
 //#include "AMF.h"
 #include "Functors.h"
@@ -32,6 +37,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
 #include <vector>
 #include <float.h>
 #include <iostream>
@@ -41,6 +49,9 @@ using std::cerr;
 using std::cout;
 using std::for_each;
 
+// The least padding left in a file -u had to rewrite, so the next update can be done in place
+static const size_t UPDATE_PADDING = 4096;
+
 /*
 void createIndex(FILE *fp, std::vector<off_t> &keyFramesBytes, std::vector<double> &keyFramesTimes) {
 	fseeko(fp, 0, SEEK_SET);
@@ -80,21 +91,267 @@ void createIndex(FILE *fp, std::vector<off_t> &keyFramesBytes, std::vector<doubl
 }
 */
 
+// A clip to cut out with -x
+struct Clip {
+	unsigned long start;
+	unsigned long end;
+	std::string filename;
+};
+
+// Reads a list of clips, one per line as "<start time> <end time> <output file>" (times in seconds)
+// Blank lines and lines starting with # are skipped. Returns false if the file can't be read or a line is bad
+bool read_clips(const char *filename, std::vector<Clip> &clips) {
+
+	FILE *fp = fopen(filename, "r");
+
+	if ( fp == NULL ) {
+		cerr << "Error " << errno << " opening '" << filename << "'" << std::endl;
+		return false;
+	}
+
+	char line[4096];
+	unsigned int lineno = 0;
+	bool ok = true;
+
+	while ( ok && fgets(line, sizeof(line), fp) != NULL ) {
+		lineno++;
+
+		// Trim the newline and any trailing space
+		size_t len = strlen(line);
+		while ( len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t') )
+			line[--len] = '\0';
+
+		const char *p = line + strspn(line, " \t");
+
+		if ( *p == '\0' || *p == '#' )
+			continue;
+
+		double start, end;
+		int n = 0;
+
+		if ( sscanf(p, "%lf %lf %n", &start, &end, &n) != 2 || p[n] == '\0' || start < 0 || end <= start ) {
+			cerr << filename << ":" << lineno << ": expected <start time> <end time> <output file>" << std::endl;
+			ok = false;
+			break;
+		}
+
+		Clip c;
+		c.start = (unsigned long) ( start * 1000 );
+		c.end = (unsigned long) ( end * 1000 );
+		c.filename = p + n;
+
+		clips.push_back( c );
+	}
+
+	fclose(fp);
+
+	return ok;
+}
+
 void display_help() {
 	cerr << "flvtool++ version " REVISION " " REVISIONDATE << std::endl << std::endl;
 
 	cerr << "Display information about a FLV file:" << std::endl;
-	cerr << "  flvtool++ -i <input file>" << std::endl << std::endl;
+	cerr << "  flvtool++ -i <input file>" << std::endl;
+	cerr << "Or just the basics, from the start and end of the file:" << std::endl;
+	cerr << "  flvtool++ -i --fast <input file>" << std::endl << std::endl;
 
 	cerr << "Indexes a FLV file, and optionally trims at start/end times (in seconds):" << std::endl;
 	cerr << "  flvtool++ <input file> <output file> (<start time> <end time>)" << std::endl << std::endl;
 
+	cerr << "Cuts many clips out of a FLV file in one pass, from a file of \"<start time> <end time> <output file>\" lines:" << std::endl;
+	cerr << "  flvtool++ -x <input file> <clips file>" << std::endl << std::endl;
+
+	cerr << "Splits a FLV file at keyframes, every so many seconds, or into n parts (named <prefix>001.flv, etc):" << std::endl;
+	cerr << "  flvtool++ -s <input file> <output prefix> <seconds>" << std::endl;
+	cerr << "  flvtool++ -s --parts <n> <input file> <output prefix>" << std::endl << std::endl;
+
+	cerr << "Runs a batch of jobs on a pool of threads, from a file with one job per line, as" << std::endl;
+	cerr << "\"index <input> <output>\", \"crop <input> <output> <start time> <end time>\" or \"info <input> (<output>)\":" << std::endl;
+	cerr << "  flvtool++ -b <jobs file>" << std::endl << std::endl;
+
 	cerr << "Joins one or more FLV files together:" << std::endl;
 	cerr << "  flvtool++ -j <input files> <output file>" << std::endl << std::endl;
+
+	cerr << "Updates the metadata and index of a FLV file in place (rewriting it if there is not enough room):" << std::endl;
+	cerr << "  flvtool++ -u <file>" << std::endl << std::endl;
+
+	cerr << "Recovers what it can of a damaged FLV file, skipping anything that isn't a tag:" << std::endl;
+	cerr << "  flvtool++ -r <input file> <output file>" << std::endl << std::endl;
+
+	cerr << "A input or output file of - reads from stdin or writes to stdout (except with -u)." << std::endl << std::endl;
+
+	cerr << "Options (given before any of the above):" << std::endl;
+	cerr << "  --mmap           Map the input files into memory instead of reading them" << std::endl;
+	cerr << "  --padding <n>    Leave n spare bytes in the metadata, so later updates can be done in place" << std::endl;
+	cerr << "  --threads <n>    Read large files, or run batches, with up to n threads (defaults to the number of CPUs)" << std::endl;
+	cerr << "  --read-ahead <n> Read n buffers ahead of writing, in another thread (helps when the input and output are on different disks)" << std::endl;
+	cerr << "  --buffer <n>     The size of each read ahead buffer in KB (defaults to 1024)" << std::endl;
+	cerr << "  --stats          Print how fast the output was written" << std::endl;
+	cerr << "  --io-uring       Keep many reads in flight with io_uring (if the kernel has it) while scanning and with --read-ahead, for storage limited by queue depth (writes still use stdio)" << std::endl;
+	cerr << "  --cache <dir>    Keep what parsing each file found in dir, so unchanged files aren't parsed again" << std::endl;
+	cerr << "  --sidecar        Write a binary index of the keyframes beside each FLV file written, as <file>.idx" << std::endl << std::endl;
+}
+
+// Reads a batch manifest, one job per line, as one of (times in seconds, file names without spaces)
+//   index <input file> <output file>
+//   crop <input file> <output file> <start time> <end time>
+//   info <input file> (<output file>)
+// Blank lines and lines starting with # are skipped. Returns false if the file can't be read or a line is bad
+bool read_jobs(const char *filename, std::vector<BatchJob> &jobs) {
+
+	FILE *fp = fopen(filename, "r");
+
+	if ( fp == NULL ) {
+		cerr << "Error " << errno << " opening '" << filename << "'" << std::endl;
+		return false;
+	}
+
+	char line[4096];
+	char kind[16], input[4096], output[4096];
+	unsigned int lineno = 0;
+	bool ok = true;
+
+	while ( ok && fgets(line, sizeof(line), fp) != NULL ) {
+		lineno++;
+
+		const char *p = line + strspn(line, " \t\r\n");
+
+		if ( *p == '\0' || *p == '#' )
+			continue;
+
+		double start = 0, end = 0;
+		int n = sscanf(p, "%15s %4095s %4095s %lf %lf", kind, input, output, &start, &end);
+
+		BatchJob job;
+		job.input = input;
+
+		if ( n == 3 && strcmp(kind, "index") == 0 ) {
+			job.kind = BatchJob::Index;
+			job.output = output;
+
+		} else if ( n == 5 && strcmp(kind, "crop") == 0 && start >= 0 && end > start ) {
+			job.kind = BatchJob::Crop;
+			job.output = output;
+			job.start = (unsigned long) ( start * 1000 );
+			job.end = (unsigned long) ( end * 1000 );
+
+		} else if ( (n == 2 || n == 3) && strcmp(kind, "info") == 0 ) {
+			job.kind = BatchJob::Info;
+			job.output = n == 3 ? output : "-";
+
+		} else {
+			n = 0;
+		}
+
+		// Every job reading stdin can't work
+		if ( n == 0 || job.input == "-" ) {
+			cerr << filename << ":" << lineno << ": expected index <input> <output>, crop <input> <output> <start time> <end time>, or info <input> (<output>)" << std::endl;
+			ok = false;
+			break;
+		}
+
+		// Nor can many threads writing FLV data to stdout at once (info jobs take turns)
+		if ( job.kind != BatchJob::Info && job.output == "-" ) {
+			cerr << filename << ":" << lineno << ": only info jobs can write to stdout" << std::endl;
+			ok = false;
+			break;
+		}
+
+		jobs.push_back( job );
+	}
+
+	fclose(fp);
+
+	return ok;
+}
+
+// Prints how each job of a batch went (to stderr, away from any info written to stdout),
+// in the order they were listed, and returns how many failed
+unsigned int print_jobs(const std::vector<BatchJob> &jobs) {
+	static const char *kinds[] = { "index", "crop", "info" };
+
+	unsigned int failed = 0;
+
+	for ( std::vector<BatchJob>::const_iterator i = jobs.begin(); i != jobs.end(); ++i ) {
+		char line[64];
+		sprintf(line, "%-6s %8.3fs  %-5s ", i->ok ? "ok" : "FAILED", i->seconds, kinds[ i->kind ]);
+
+		cerr << line << i->input << " -> " << i->output;
+
+		if ( !i->ok ) {
+			cerr << "  (" << i->error << ")";
+			failed++;
+		} else if ( i->tags > 0 ) {
+			cerr << "  (" << i->tags << " tags)";
+		}
+
+		cerr << std::endl;
+	}
+
+	return failed;
+}
+
+// Prints how much tag data a save wrote and how fast, to help tune --read-ahead and --buffer
+template <class Stream>
+void print_rate(const Stream &flv) {
+	char line[128];
+	double mb = flv.getSavedBytes() / (1024.0 * 1024.0);
+	double secs = flv.getSaveSeconds();
+
+	sprintf(line, "Wrote %.1f MB of tag data in %.2f s (%.1f MB/s)", mb, secs, secs > 0 ? mb / secs : 0.0);
+	cerr << line << std::endl;
 }
 
 int main(int argc, char* argv[]) {
 
+	InputFile::Mode mode = InputFile::Stdio;
+	size_t padding = 0;
+	unsigned int threads = Thread::cpus();
+	size_t depth = 0;
+	size_t buflen = ReadAhead::DEFAULT_BUFFER_LEN;
+	bool stats = false;
+	bool sidecar = false;
+
+	// Strip off the options, so the commands are left in the same place
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--mmap") == 0) {
+			mode = InputFile::Mmap;
+		} else if (strcmp(argv[1], "--padding") == 0 && argc > 2) {
+			padding = (size_t) atol( argv[2] );
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+			threads = (unsigned int) atoi( argv[2] );
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--read-ahead") == 0 && argc > 2) {
+			depth = (size_t) atol( argv[2] );
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--buffer") == 0 && argc > 2 && atol( argv[2] ) > 0) {
+			buflen = (size_t) atol( argv[2] ) * 1024;
+			argv++;
+			argc--;
+		} else if (strcmp(argv[1], "--stats") == 0) {
+			stats = true;
+		} else if (strcmp(argv[1], "--io-uring") == 0) {
+			IoUring::enable(true);
+		} else if (strcmp(argv[1], "--sidecar") == 0) {
+			sidecar = true;
+		} else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+			ScanCache::setDirectory( argv[2] );
+			argv++;
+			argc--;
+		} else {
+			display_help();
+			return -1;
+		}
+
+		argv++;
+		argc--;
+	}
+
 	if (argc <= 1) {
 		display_help();
 		return -1;
@@ -109,55 +366,222 @@ int main(int argc, char* argv[]) {
 			return -1;
 		}
 
-		// This stores all the input FLVStreams
-		std::vector<FLVStream *> files;
+		std::vector<std::string> filenames ( argv + 2, argv + argc - 1 );
 
 		try {
-			// Create a output stream
-			FLVStream out;
-
-			// Now create a FLVStream for each input file
-			for (int i = 2; i < (argc - 1); i++ ) {
-				FLVStream * in = new FLVStream ( argv[ i ] );
-
-				// We store the FLVStream because it has to exist atleast until we save the output file,
-				// otherwise FILE* get broken. Really this should be done in a "better" way
-				files.push_back ( in );
-
-				out.append( *in );
-			}
+			// Parse all the files, and join them into one stream
+			FLVJoiner join ( filenames, mode, threads );
+			FLVStream &out = join.stream();
 
 			// Add some useful metadata & index
 			out.addMetaData();
+			out.setPadding( padding );
 			out.addIndex();
 
+			out.setReadAhead( depth, buflen );
+			out.setSidecar( sidecar );
 			out.save( argv[ argc - 1 ] );
 
-			for_each(files.begin(), files.end(), DeleteObject() );
-			files.clear();
+			if ( stats )
+				print_rate( out );
 
 		} catch (const std::runtime_error & e) {
+			cerr << e.what() << std::endl;
+			return -1;
+
+		} catch (const char *c) {
+			cerr << c << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	// Do we want to recover a damaged file?
+	if (strcmp(argv[1], "-r") == 0) {
+
+		if (argc != 4) {
+			display_help();
+			return -1;
+		}
+
+		try {
+			// The recovery jumps around the file, which is much cheaper if it is mapped
+			FLVStream flv ( argv[2], ~0, false, InputFile::Mmap, threads, true );
+
+			const std::vector< std::pair<off_t, off_t> > &skipped = flv.getSkipped();
+			off_t total = 0;
+
+			for (size_t i = 0; i < skipped.size(); i++) {
+				cerr << "Skipped " << skipped[i].second << " bytes at " << skipped[i].first << std::endl;
+				total += skipped[i].second;
+			}
+
+			cerr << "Recovered " << flv.getTagCount() << " tags, skipped " << total << " bytes in " << skipped.size() << " places" << std::endl;
+
+			if ( flv.getTagCount() == 0 ) {
+				cerr << "Nothing could be recovered" << std::endl;
+				return -1;
+			}
+
+			flv.addMetaData();
+			flv.setPadding( padding );
+			flv.addIndex();
+			flv.setReadAhead( depth, buflen );
+			flv.setSidecar( sidecar );
+			flv.save( argv[3] );
 
-			// Clean up a little
-			for_each(files.begin(), files.end(), DeleteObject() );
+			if ( stats )
+				print_rate( flv );
 
+		} catch ( const std::runtime_error &e ) {
 			cerr << e.what() << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	// Do we want to cut out many clips?
+	if (strcmp(argv[1], "-x") == 0) {
 
+		std::vector<Clip> clips;
+
+		if (argc != 4) {
+			display_help();
 			return -1;
+		}
 
-		} catch (const char *c) {
+		if ( !read_clips( argv[3], clips ) )
+			return -1;
 
-			// Clean up a little
-			for_each(files.begin(), files.end(), DeleteObject() );
+		std::vector<FLVStream *> flvs;
+		std::vector<std::string> filenames;
 
-			cerr << c << std::endl;
+		try {
+			// Parse the input once, every clip is just a range of its tags
+			FLVStream flv ( argv[2], ~0, false, mode, threads );
+
+			for (size_t i = 0; i < clips.size(); i++) {
+				flvs.push_back( flv.clip( clips[i].start, clips[i].end ) );
+				filenames.push_back( clips[i].filename );
+
+				flvs.back()->addMetaData();
+				flvs.back()->setPadding( padding );
+				flvs.back()->addIndex();
+				flvs.back()->setSidecar( sidecar );
+			}
+
+			flv.saveClips( flvs, filenames );
+
+		} catch ( const std::runtime_error &e ) {
+			for_each(flvs.begin(), flvs.end(), DeleteObject());
+			cerr << e.what() << std::endl;
+			return -1;
+		}
+
+		for_each(flvs.begin(), flvs.end(), DeleteObject());
+		return 0;
+	}
+
+	// Do we want to run a batch of jobs?
+	if (strcmp(argv[1], "-b") == 0) {
+
+		if (argc != 3) {
+			display_help();
+			return -1;
+		}
+
+		std::vector<BatchJob> jobs;
+
+		if ( !read_jobs( argv[2], jobs ) )
+			return -1;
+
+		Batch::Options options;
+		options.mode = mode;
+		options.padding = padding;
+		options.depth = depth;
+		options.buflen = buflen;
+		options.sidecar = sidecar;
+
+		double began = wall_seconds();
+
+		Batch batch ( jobs, options );
+		batch.run( threads );
+
+		unsigned int failed = print_jobs( jobs );
+
+		char line[128];
+		sprintf(line, "%u jobs, %u failed, in %.2f s", (unsigned int)jobs.size(), failed, wall_seconds() - began);
+		cerr << line << std::endl;
+
+		return failed > 0 ? -1 : 0;
+	}
+
+	// Do we want to split?
+	if (strcmp(argv[1], "-s") == 0) {
+
+		unsigned int parts = 0;
+		double seconds = 0;
+
+		if (argc == 6 && strcmp(argv[2], "--parts") == 0) {
+			parts = (unsigned int) atoi( argv[3] );
+			argv += 2;
+
+		} else if (argc == 5) {
+			seconds = atof( argv[4] );
+		}
+
+		if ( parts == 0 && seconds <= 0 ) {
+			display_help();
+			return -1;
+		}
 
+		try {
+			FLVStream flv ( argv[2], ~0, false, mode, threads );
+
+			// Parts are split by time, so they take about as long to play (and transcode)
+			unsigned int interval = (unsigned int) ( seconds * 1000 );
+
+			if ( parts > 0 )
+				interval = ( flv.duration() + parts - 1 ) / parts;
+
+			std::vector<size_t> points = flv.splitPoints( interval );
+
+			// Timestamps that wrap make the duration too short, so the last part takes the rest
+			if ( parts > 0 && points.size() > parts )
+				points.resize( parts );
+			std::vector<std::string> filenames;
+
+			for (size_t i = 0; i < points.size(); i++) {
+				char num[16];
+				sprintf(num, "%03u.flv", (unsigned int)(i + 1));
+				filenames.push_back( std::string( argv[3] ) + num );
+			}
+
+			flv.setReadAhead( depth, buflen );
+			flv.setSidecar( sidecar );
+			flv.split( points, filenames, padding, threads );
+
+			cerr << "Split into " << points.size() << " segments" << std::endl;
+
+		} catch ( const std::runtime_error &e ) {
+			cerr << e.what() << std::endl;
 			return -1;
 		}
 
 		return 0;
 	}
 
+	// -i --fast only reads the start and end of the file
+	bool fast = false;
+
+	if (argc == 4 && strcmp(argv[1], "-i") == 0 && strcmp(argv[2], "--fast") == 0) {
+		fast = true;
+		argv[2] = argv[3];
+		argc--;
+	}
+
 	// All the remaining commands need 2 or 4 arguments
 	if (argc != 3 && argc != 5) {
 		display_help();
@@ -168,7 +592,19 @@ int main(int argc, char* argv[]) {
 	if (strcmp(argv[1], "-i") == 0) {
 
 		try {
-			FLVStream flv ( argv[2], ~0, true );
+			if ( fast ) {
+				try {
+					FLVProbe probe ( argv[2], mode );
+					probe.printInfo();
+					return 0;
+
+				} catch ( const std::runtime_error &e ) {
+					cerr << "Fast probe failed (" << e.what() << "), reading the whole file" << std::endl;
+				}
+			}
+
+			// Printing every tag only reads forward, so a pipe is read as it arrives rather than spooled
+			FLVStream flv ( argv[2], ~0, true, strcmp(argv[2], "-") == 0 ? InputFile::Stream : mode );
 			flv.printInfo();
 
 		} catch ( const std::runtime_error &e ) {
@@ -179,7 +615,81 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
+	// Do we want to update in place?
+	if (strcmp(argv[1], "-u") == 0) {
+
+		if (argc != 3 || strcmp(argv[2], "-") == 0) {
+			display_help();
+			return -1;
+		}
+
+		try {
+			std::auto_ptr<FLVStream> flv ( new FLVStream ( argv[2], ~0, false, mode, threads ) );
+
+			flv->setSidecar( sidecar );
+
+			// Try and make the new metadata fit where the old one was
+			flv->keepMetaSize();
+
+			flv->addMetaData();
+			flv->addIndex();
+
+			if ( !flv->saveInPlace() ) {
+
+				// It didn't fit, so write out a new file (with some room for next time, even without --padding)
+				std::string tmp = std::string( argv[2] ) + ".tmp";
+
+				flv->setPadding( std::max( padding, UPDATE_PADDING ) );
+				flv->addIndex();
+				flv->setReadAhead( depth, buflen );
+				flv->save( tmp.c_str() );
+
+				if ( stats )
+					print_rate( *flv );
+
+				// Close the old file before replacing it
+				flv.reset();
+
+				if ( rename( tmp.c_str(), argv[2] ) ) {
+					remove( tmp.c_str() );
+					cerr << "Error " << errno << " replacing '" << argv[2] << "'" << std::endl;
+					return -1;
+				}
+
+				// The index was written beside the temporary file, so it follows it
+				if ( sidecar && rename( KeyFrameIndex::filename( tmp.c_str() ).c_str(), KeyFrameIndex::filename( argv[2] ).c_str() ) ) {
+					cerr << "Error " << errno << " replacing '" << KeyFrameIndex::filename( argv[2] ) << "'" << std::endl;
+					return -1;
+				}
+			}
+
+		} catch ( const std::runtime_error &e ) {
+			cerr << e.what() << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
 	try {
+		// Without cropping, stream the file through rather than loading every tag
+		// (unless there is a cache, which keeps the table of tags that streaming doesn't make)
+		if (argc == 3 && !ScanCache::enabled()) {
+			FLVIndexer flv ( argv[1], mode );
+
+			flv.addMetaData();
+			flv.setPadding( padding );
+			flv.addIndex();
+			flv.setReadAhead( depth, buflen );
+			flv.setSidecar( sidecar );
+			flv.save( argv[2] );
+
+			if ( stats )
+				print_rate( flv );
+
+			return 0;
+		}
+
 		std::auto_ptr<FLVStream> flv;
 
 		// Check if we want to chop
@@ -187,22 +697,30 @@ int main(int argc, char* argv[]) {
 			unsigned long startTime = (unsigned long) ( atof( argv[3] ) * 1000 );
 			unsigned long endTime = (unsigned long) ( atof( argv[4] ) * 1000 );
 
-			flv.reset (  new FLVStream ( argv[1], endTime ) );
+			flv.reset (  new FLVStream ( argv[1], endTime, false, mode ) );
 			flv->crop( startTime, endTime );
 
 		} else {
-			flv.reset (  new FLVStream ( argv[1] ) );
+			flv.reset (  new FLVStream ( argv[1], ~0, false, mode, threads ) );
 		}
 
 		// Add some useful metadata
 		flv->addMetaData();
 
+		// Leave room to update the metadata in place later
+		flv->setPadding( padding );
+
 		// Now add the index
 		flv->addIndex();
 
 		// Now write this new flv file out
+		flv->setReadAhead( depth, buflen );
+		flv->setSidecar( sidecar );
 		flv->save( argv[2] );
 
+		if ( stats )
+			print_rate( *flv );
+
 	} catch (const std::runtime_error & e) {
 		cerr << e.what() << std::endl;
 		return -1;
@@ -0,0 +1,155 @@
+/*
+	flvtool++ 1.0
+	This source is part of flvtool, a generic FLV file editor
+	Copyright Andrew Brampton, Lancaster University
+
+	This file is released free to use for academic and non-commercial purposes.
+	If you wish to use this product for commercial reasons, then please contact us
+
+	Writes a made up FLV file for the tests (see roundtrip.sh), so they don't need any real video:
+		mkflv <output file> <seconds> (--nometa) (--small) (--start <ms>)
+
+	There is a Sorenson H.263 video tag every 40ms (a 320x240 keyframe every second), and a MP3
+	audio tag after each. The data after the picture header is junk, but always the same junk.
+	--nometa leaves out the meta data tag, --small makes every tag tiny, and --start makes the first
+	tag start at ms instead of 0
+*/
+
+#include "../common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+
+// Fills data with junk from seed, which is moved on
+static void junk(unsigned char *data, size_t len, unsigned int &seed) {
+	for ( size_t i = 0; i < len; i++ ) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (unsigned char)( seed >> 16 );
+	}
+}
+
+static void writeString(FILE *fp, const char *s) {
+	fwrite_16(fp, (unsigned short) strlen(s) );
+	fwrite_s(fp, s, strlen(s));
+}
+
+static void writeTag(FILE *fp, unsigned char type, unsigned int timestamp, const std::vector<unsigned char> &data) {
+	fwrite_8(fp, type);
+	fwrite_24(fp, (unsigned int) data.size() );
+	fwrite_24(fp, timestamp & 0xFFFFFF);
+	fwrite_8(fp, (unsigned char)( timestamp >> 24 ));
+	fwrite_24(fp, 0); // Stream ID
+
+	if ( !data.empty() )
+		fwrite_s(fp, &data[0], data.size());
+
+	fwrite_32(fp, (unsigned int) data.size() + 11);
+}
+
+// A onMetaData tag, holding a couple of things that indexing replaces or keeps
+static void writeMeta(FILE *fp, unsigned int seconds) {
+	FILE *tmp = tmpfile();
+
+	if ( tmp == NULL )
+		throw vargs_exception("Error %d creating a temporary file\n", errno);
+
+	fwrite_8(tmp, 2); // String
+	writeString(tmp, "onMetaData");
+
+	fwrite_8(tmp, 8); // Mixed array
+	fwrite_32(tmp, 2);
+
+	writeString(tmp, "duration");
+	fwrite_8(tmp, 0); // Double
+	fwrite_64(tmp, seconds);
+
+	writeString(tmp, "creator");
+	fwrite_8(tmp, 2);
+	writeString(tmp, "mkflv");
+
+	fwrite_s(tmp, "\x00\x00\x09", 3);
+
+	std::vector<unsigned char> data ( (size_t) ftell(tmp) );
+	rewind(tmp);
+	fread_s(tmp, &data[0], data.size());
+	fclose(tmp);
+
+	writeTag(fp, 0x12, 0, data);
+}
+
+int main(int argc, char* argv[]) {
+
+	if ( argc < 3 ) {
+		fprintf(stderr, "mkflv <output file> <seconds> (--nometa) (--small) (--start <ms>)\n");
+		return -1;
+	}
+
+	unsigned int seconds = (unsigned int) atoi( argv[2] );
+	bool meta = true;
+	bool small = false;
+	unsigned int start = 0;
+
+	for ( int i = 3; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--nometa") == 0 )
+			meta = false;
+		else if ( strcmp(argv[i], "--small") == 0 )
+			small = true;
+		else if ( strcmp(argv[i], "--start") == 0 && i + 1 < argc )
+			start = (unsigned int) atoi( argv[++i] );
+	}
+
+	FILE *fp = fopen(argv[1], "wb");
+
+	if ( fp == NULL ) {
+		fprintf(stderr, "Error %d opening output file '%s'\n", errno, argv[1]);
+		return -1;
+	}
+
+	try {
+		fwrite_s(fp, "FLV", 3);
+		fwrite_8(fp, 1); // Version
+		fwrite_8(fp, 5); // Audio and video
+		fwrite_32(fp, 9);
+		fwrite_32(fp, 0);
+
+		if ( meta )
+			writeMeta(fp, seconds);
+
+		unsigned int seed = 1;
+
+		for ( unsigned int ms = 0; ms < seconds * 1000; ms += 40 ) {
+			bool key = ms % 1000 == 0;
+
+			// |flags| pictureStartCode (17 bits) | version (5) | temporalReference (8) | pictureSize (3) = 1 | width (16) | height (16) |
+			std::vector<unsigned char> video ( small ? (key ? 24 : 12) : (key ? 4000 : 1000) );
+			junk(&video[0], video.size(), seed);
+
+			const unsigned char picture[] = { 0x00, 0x00, 0x80, 0x00, 0x80, 0xA0, 0x00, 0x78, 0x00 };
+
+			video[0] = key ? 0x12 : 0x22;
+			memcpy(&video[1], picture, sizeof(picture));
+
+			writeTag(fp, 0x09, start + ms, video);
+
+			std::vector<unsigned char> audio ( small ? 8 : 200 );
+			junk(&audio[0], audio.size(), seed);
+			audio[0] = 0x2E; // MP3 44kHz 16bit mono
+
+			writeTag(fp, 0x08, start + ms, audio);
+		}
+
+	} catch ( const std::runtime_error &e ) {
+		fprintf(stderr, "%s\n", e.what());
+		fclose(fp);
+		return -1;
+	}
+
+	if ( fclose(fp) ) {
+		fprintf(stderr, "Error %d writing '%s'\n", errno, argv[1]);
+		return -1;
+	}
+
+	return 0;
+}
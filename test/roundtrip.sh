@@ -0,0 +1,123 @@
+#!/bin/sh
+#	flvtool++ 1.0
+#	This source is part of flvtool, a generic FLV file editor
+#	Copyright Andrew Brampton, Lancaster University
+#
+#	This file is released free to use for academic and non-commercial purposes.
+#	If you wish to use this product for commercial reasons, then please contact us
+#
+#	Run by "make check". Indexes, crops, joins and splits made up files (see mkflv.cpp) with each
+#	of the ways flvtool++ can read them, and checks they all write exactly the same files:
+#		roundtrip.sh <flvtool++> <mkflv>
+
+set -e
+
+FLVTOOL=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+MKFLV=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR"
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+# Checks two files are the same
+same() {
+	cmp "$1" "$2" > /dev/null || fail "$1 and $2 differ"
+}
+
+# Checks a file is the same as output that was checked by hand (its cksum then, which changes if mkflv does)
+known() {
+	[ "$(cksum < "$1")" = "$2" ] || fail "$1 is not the known good output"
+}
+
+run() {
+	"$FLVTOOL" "$@" > /dev/null || fail "flvtool++ $*"
+}
+
+"$MKFLV" a.flv 60
+"$MKFLV" nm.flv 20 --nometa
+
+# Everything is done once with the default options, as the reference, then again with the others
+echo "basic"
+mkdir ref
+run a.flv ref/index.flv
+run a.flv ref/crop.flv 10 20
+run nm.flv ref/cropnm.flv 0 5
+run -j a.flv nm.flv ref/join.flv
+run -s a.flv ref/part 10
+run -j ref/part*.flv ref/split.flv
+"$FLVTOOL" -i a.flv > ref/info || fail "flvtool++ -i a.flv"
+
+for opts in "--read-ahead 1 --buffer 1" "--read-ahead 4" "--mmap" "--io-uring" "--io-uring --read-ahead 4"; do
+	echo "$opts"
+	rm -rf out
+	mkdir out
+	run $opts a.flv out/index.flv
+	run $opts a.flv out/crop.flv 10 20
+	run $opts nm.flv out/cropnm.flv 0 5
+	run $opts -j a.flv nm.flv out/join.flv
+	run $opts -s a.flv out/part 10
+	run $opts -j out/part*.flv out/split.flv
+	"$FLVTOOL" $opts -i a.flv > out/info || fail "flvtool++ $opts -i a.flv"
+
+	for f in index.flv crop.flv cropnm.flv join.flv split.flv info; do
+		same ref/$f out/$f
+	done
+	for f in ref/part*.flv; do
+		same $f out/$(basename $f)
+	done
+done
+
+# Indexing a indexed file changes nothing
+echo "index"
+run ref/index.flv again.flv
+same ref/index.flv again.flv
+
+# A file without meta data, which starts late, gets a new meta data tag at 0ms, so its duration is
+# from 0, and is the same whether it was indexed in two passes or (with --cache) from a tag table
+"$MKFLV" late.flv 20 --nometa --start 5000
+run late.flv late.flv.1
+run --cache cache late.flv late.flv.2
+same late.flv.1 late.flv.2
+"$FLVTOOL" -i late.flv.1 | grep -q '"duration": *24.96$' || fail "late.flv's duration is not 24.96"
+
+# Crops are compared with known good output. They start from the last keyframe before the start
+# time (so 10 20 starts at 9s), and keep the first tag, the meta data or the first keyframe, when
+# cropping from the beginning. Cutting clips out with -x is the same as cropping them
+echo "crop"
+run a.flv crop0.flv 0 5
+known crop0.flv "2111114116 173282"
+known ref/crop.flv "3557551585 375873"
+known ref/cropnm.flv "3171787410 173265"
+
+printf "0 5 clip0.flv\n10 20 clip.flv\n" > clips
+run -x a.flv clips
+same crop0.flv clip0.flv
+same ref/crop.flv clip.flv
+
+# Updating a indexed file in place changes nothing
+echo "update"
+cp ref/index.flv update.flv
+run -u update.flv
+same ref/index.flv update.flv
+
+# Joining thousands of files, with far fewer file handles than that
+echo "3000 file join"
+"$MKFLV" long.flv 3000 --small --nometa
+mkdir long
+run -s --parts 3000 long.flv long/x
+[ $(ls long | wc -l) -eq 3000 ] || fail "long.flv was not split into 3000 parts"
+run -j long/x*.flv longref.flv
+
+for opts in "" "--read-ahead 1 --buffer 1" "--io-uring --read-ahead 8"; do
+	echo "ulimit -n 64 $opts"
+	rm -f longjoin.flv
+	( ulimit -n 64 && "$FLVTOOL" $opts -j long/x*.flv longjoin.flv > /dev/null ) || fail "flvtool++ $opts -j with ulimit -n 64"
+	same longref.flv longjoin.flv
+done
+
+echo "all passed"